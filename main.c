@@ -7,6 +7,12 @@
 #include <pthread.h>
 #include <signal.h>
 #include <locale.h>
+#include <limits.h>
+#include <stdint.h>
+#include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifdef _WIN32
 
@@ -21,43 +27,73 @@
 
 #else
 #include <ncurses.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 
 #define NS 1000000000L // Количество наносекунд в секунде
 #define DEFAULT_TARGET_TPS 30
-#define DEFAULT_WATER_ITERATIONS 50 // Amount of iterations for smoother water physics
+#define DEFAULT_TARGET_FPS 60 // Как часто отрисовка проверяет, не появилось ли что-то новое
+#define DEFAULT_WATER_DISPERSION 8 // На сколько клеток за тик может утечь вода
+#define AUTO_HIDE_MS 1000 // Через сколько миллисекунд без действий прячется курсор при --auto-hide
 #define CURSOR_ID 10 // Номер цветовой пары для курсора
 #define CURSOR_SPRITE '*' // Символ курсора, если будет пробел на карте на месте курсора
 #define NUM_CELL_TYPES 9 // Количество типов клеток
 #define CS_SPACES 4 // Сколько пробелов будет между названиями ячеек в меню
+#define VALUE_FLAGS "TFwjS" // Короткие опции, после которых идёт значение
+#define FRAME_PROTECT 0x80 // Флаг A_PROTECT в FrameCell.attr
+#define FRAME_GAP 2 // Сколько неизменившихся символов можно перезаписать, чтобы склеить два изменения в строке
+#define NUM_PAIRS (CURSOR_ID + NUM_CELL_TYPES) // Количество цветовых пар, включая пары курсора для огня и пара
+#define SGR_MAX 40 // Максимальная длина escape-последовательности, которая меняет цвет символа и фона
+#define CHUNK_SIZE 32 // Размер стороны чанка в клетках
+#define BLAST_REACH 11 // Как далеко от бомбы взрыв может изменить клетку: радиус 4 и отброс ещё до 7 клеток
+#define BLAST_RADIUS 4 // Взрыв переписывает квадрат с этим радиусом вокруг бомбы
+#define BOMB_FUSE 50 // Через сколько тиков бомба взрывается сама
+#define FUSE_WHEEL 64 // Вёдер в колесе таймеров бомб, должно быть больше BOMB_FUSE
+#define FUSE_QUEUED 0x4000 // Бит в таймере бомбы: она стоит в колесе, а младшие биты – номер тика, когда она взорвётся
+#define FUSE_TICK_MASK 0x3FFF
+#define EDIT_RING_SIZE 1024 // Сколько правок поля может ждать начала тика (степень двойки)
+#define SAVE_MAGIC "TSBX" // Первые байты файла сохранения
+#define SAVE_VERSION 1 // Версия формата сохранения, меняется при любом несовместимом изменении
+#define SAVE_CHUNK_AWAKE 1 // Флаг в SaveChunk.flags: чанк не спал, когда поле сохраняли
+#define DEFAULT_SAVE_FILE "sandbox.sav"
+#define REPLAY_VERSION 11 // Версия формата файла записи, меняется и тогда, когда то же зерно даёт другую симуляцию
+#define NOTICE_MS 2000 // Сколько миллисекунд сообщение (например, о сохранении) висит в строке состояния
+#define MAX_CATCHUP 4 // На сколько тиков симуляция может отстать от расписания и догнать его, прежде чем они будут пропущены
+#define PROFILE_INTERVAL_MS 1000 // Как часто собирается замер для панели профилирования и --stats-file
+#define PROFILE_WIDTH 44 // Ширина панели профилирования в символах
+#define TICK_SAMPLES 1024 // Сколько последних длительностей тика и кадра хранится для p50/p99
+#define SNAPSHOT_FRESH 4 // Флаг в Snapshots.ready: снимок опубликован, но ещё не забран отрисовкой
+#define POOL_SPIN 4000 // Сколько раз поток пула проверяет новую фазу, прежде чем уснуть
+#define THREADS_PER_CPU 4 // Больше потоков на ядро, чем столько, --threads не запускает
+
+// Одновременно обновляются чанки через один, поэтому всё, до чего дотягивается клетка одного из них,
+// не должно пересекаться с тем, до чего дотягивается клетка другого
+_Static_assert(2*BLAST_REACH <= CHUNK_SIZE, "CHUNK_SIZE is too small for parallel update");
+#define MAX_WATER_DISPERSION (BLAST_REACH-1) // Вода вместе с touch_around не должна дотягиваться дальше взрыва
+#define MAX_FALL_SPEED 8 // Сколько клеток за тик может пролететь падающая клетка
+_Static_assert(MAX_FALL_SPEED < BLAST_REACH, "MAX_FALL_SPEED reaches past BLAST_REACH");
+_Static_assert(BOMB_FUSE < FUSE_WHEEL, "FUSE_WHEEL is too small for BOMB_FUSE");
+// Строка чанка вместе с соседней клеткой с каждой стороны должна влезать в 64-битную маску granular_row
+_Static_assert(CHUNK_SIZE + 2 <= 64, "CHUNK_SIZE is too big for granular_row");
 
 #define MAPW (COLS-2) // Ширина поля с ячейками на основе размера терминала
 #define MAPH (LINES-2) // Высота поля с ячейками на основе размера терминала
 
-#define random() (rand() % 100 / 100.0f)
+#define rnd(n) ((int)rng_below(&thread_rng, n)) // Случайное число в диапазоне 0..n-1 из генератора текущего потока
+#define chance(num, den) (rnd(den) < (num)) // Событие с вероятностью num/den
 #define sign(x) (x < 0 ? -1 : 1)
 #define clr(x) (short)(x/255.0f * 1000)
 #define incursor(x_, y_, cursor) (!cursor.hide && \
                                   x_ >= cursor.x-cursor.brush_size+1 && x_ <= cursor.x+cursor.brush_size-1 && \
                                   y_ >= cursor.y-(cursor.brush_size/(2-square_pixels))+square_pixels && y_ <= cursor.y+(cursor.brush_size/(2-square_pixels))-square_pixels) // Находится ли кнопка в пределах курсора
 
-#define canmove(cellidx) ((map.cells[cellidx].type == EMPTY  ||  \
-                           map.cells[cellidx].type == WATER  ||  \
-                           map.cells[cellidx].type == STEAM) && \
-                           !map.cells[cellidx].skip_update) // Проверка клетки на то, что она нетвёрдая
-#define canmover(cellidx, x) ((x < map.width-1) && canmove(cellidx)) // Проверка клетки на то, что она нетвёрдая, и проверка на границы справа
-#define canmovel(cellidx, x) ((x > 0) && canmove(cellidx)) // Проверка клетки на то, что она нетвёрдая, и проверка на границы слева
-
-#define watercanmove(cellidx) ((map.cells[cellidx].type == EMPTY ||  \
-                                map.cells[cellidx].type == STEAM) && \
-                                !map.cells[cellidx].skip_update) // Проверка на то, может ли в клетку перейти вода
-#define watercanmover(cellidx, x) ((x < map.width-1) && watercanmove(cellidx)) // Проверка на то, может ли в клетку перейти вода, границы справа
-#define watercanmovel(cellidx, x) ((x > 0) && watercanmove(cellidx)) // Проверка на то, может ли в клетку перейти вода, границы слева
-
-#define steamcanmove(cellidx) (map.cells[cellidx].type == EMPTY && \
-                               !map.cells[cellidx].skip_update)
-#define steamcanmover(cellidx, x) ((x < map.width-1) && steamcanmove(cellidx))
-#define steamcanmovel(cellidx, x) ((x > 0) && steamcanmove(cellidx))
+// Можно ли занять место клетки IDX: её тип есть в маске ENTER (строка displace_mask) и её ещё не обновляли в этом проходе.
+// Границы поля проверяет вызывающий
+#define canenter(enter, idx) (((enter) >> map.types[idx] & 1) && map.updated[idx] != update_stamp)
 
 #define swap(a, b, t)                   \
         do {                            \
@@ -66,6 +102,14 @@
             b = t;                      \
         } while (0) 
 
+#define movecurrent(idx) do { swap(map.types[current], map.types[idx], t); moved_to = idx; touch_around(map, x, y); } while (0) // Поменять текущую клетку с соседней
+#define touch_around(map, x, y) map_touch_rect(map, (x)-1, (y)-1, (x)+1, (y)+1) // Клетка изменилась: будим её и всех, кто может на это отреагировать
+#define keep_awake(map, x, y) map_touch_rect(map, x, y, x, y) // Клетка хочет обновиться и в следующем тике (таймер, случайность)
+// Меняет тип клетки и учитывает это в населении. Перемещения (обмен двух клеток) население не меняют
+#define set_type(map, idx, type) do { unsigned char new_type = (type); population_delta[(map).types[idx]]--; \
+    population_delta[new_type]++; (map).types[idx] = new_type; } while (0)
+#define population_of(map, type) ((map).population[type] + population_delta[type]) // Вместе с изменениями этого потока
+
 enum newcolors {
     COLOR_GRAY = 16,
     COLOR_DARKGRAY,
@@ -87,6 +131,69 @@ typedef enum {
     STEAM
 } CellType; // Тип ячейки
 
+typedef enum {
+    MOB_STATIC, // Стоит на месте
+    MOB_POWDER, // Сыпется вниз и по диагонали вниз
+    MOB_LIQUID, // Льётся вниз, по диагонали вниз и растекается в стороны
+    MOB_GAS, // Летает во все стороны, чаще вверх
+} Mobility; // Как клетка двигается
+
+enum {
+    CELL_DISPLACEABLE = 1, // Более тяжёлые подвижные клетки могут занять её место
+    CELL_FLAMMABLE = 2, // Огонь перекидывается на неё
+    CELL_QUENCHES = 4, // Тушит соседний огонь и сама превращается в becomes
+    CELL_IGNITES = 8, // Поджигает соседние бомбы
+    CELL_BURNING = 16, // Горит: перекидывается на соседей и гаснет, оставляя becomes
+    CELL_EXPLOSIVE = 32, // Взрывается от соседа с CELL_IGNITES или по таймеру
+};
+
+typedef struct {
+    unsigned char density; // Подвижная клетка вытесняет только те, что легче неё
+    unsigned char mobility; // Mobility
+    unsigned char flags; // CELL_DISPLACEABLE и т. д.
+    unsigned char becomes; // Во что превращается клетка, когда тушит огонь или догорает
+    unsigned char inertia; // Газ двигается в среднем раз в столько тиков
+} CellProps; // Свойства типа клетки. Новый материал – это новая строка в cell_props
+
+const CellProps cell_props[NUM_CELL_TYPES] = {
+    [EMPTY] = {0, MOB_STATIC, CELL_DISPLACEABLE, EMPTY, 0},
+    [SAND] = {3, MOB_POWDER, 0, SAND, 0},
+    [WATER] = {2, MOB_LIQUID, CELL_DISPLACEABLE | CELL_QUENCHES, STEAM, 0},
+    [STONE] = {9, MOB_STATIC, 0, STONE, 0},
+    [WOOD] = {9, MOB_STATIC, CELL_FLAMMABLE, WOOD, 0},
+    [ASH] = {3, MOB_POWDER, 0, ASH, 0},
+    [FIRE] = {9, MOB_STATIC, CELL_IGNITES | CELL_BURNING, ASH, 0},
+    [BOMB] = {9, MOB_STATIC, CELL_EXPLOSIVE, BOMB, 0},
+    [STEAM] = {1, MOB_GAS, CELL_DISPLACEABLE, STEAM, 5},
+};
+
+typedef struct {
+    signed char dx, dy; // Куда сдвинуться относительно клетки
+    bool either; // Влево или вправо наугад (dx не используется)
+    bool settle_gas; // Вытесненный газ в этом проходе больше не двигается
+} MoveRule; // Решение, куда сдвинуться, для одной маски соседей
+
+enum {
+    NEAR_B = 1, // Снизу
+    NEAR_BL = 2, // Снизу слева
+    NEAR_BR = 4, // Снизу справа
+    NEAR_L = 8, // Слева
+    NEAR_R = 16, // Справа
+    NEAR_MASKS = 32,
+}; // Биты маски соседей, на место которых клетка может сдвинуться
+
+enum {
+    REACT_NONE, // Ничего не происходит
+    REACT_QUENCH, // Огонь гаснет и тушит соседей с CELL_QUENCHES
+    REACT_SPREAD, // Огонь может перекинуться на горючего соседа
+    REACT_BURN_OUT, // Огню некуда перекинуться: он гаснет
+    REACT_FUSE, // Бомба ждёт своего таймера
+    REACT_DETONATE, // Бомба взрывается
+    REACT_KIND = 7, // Биты самой реакции
+    REACT_IGNITE_BOMBS = 8, // Вместе с реакцией огня: рядом бомбы, которые он взрывает
+    REACT_MASKS = 64, // Все флаги клеток помещаются в шесть бит
+}; // Реакции неподвижных клеток, которые react_cell выбирает по флагам соседей
+
 typedef struct {
     const char *sprites; // Символы, которые соответствуют клтке
     const char *name; // Название клетки
@@ -94,17 +201,219 @@ typedef struct {
 } CellInfo;
 
 typedef struct {
-    CellType type;
-    bool skip_update; // Надо ли пропустить ячейку, когда её надо будет обновить
-    bool skip_render; // Балы ячейка уже выведена в терминал для пропуска во время отрисовки уже напечатаных ячеек
-    short timer; // Тайиер, нужен для задержки
-} Cell;
+    bool awake; // Есть ли в чанке что обновлять в текущем тике
+    int x0, y0, x1, y1; // Грязный прямоугольник текущего тика (включительно, в координатах карты)
+    int nx0, ny0, nx1, ny1; // Грязный прямоугольник, который накапливается для следующего тика
+} Chunk;
+
+typedef struct {
+    int *cells; // Индексы клеток с водой
+    int *sorted; // Буфер для раскладки списка по строкам перед проходом
+    int *row_start; // Начало каждой строки в отсортированном списке
+    int len, cap, sorted_cap;
+    unsigned char *listed; // Для каждой клетки карты: есть ли она в списке
+    bool stale; // Карту меняли в обход списка, до следующего основного прохода вода обходится полным проходом
+} WaterList;
+
+// Горящие клетки. Огонь обновляется только отсюда, поэтому его работа растёт с числом горящих клеток,
+// а не с размером того, что может загореться
+typedef struct {
+    int *cells; // Индексы горящих клеток (и тех, что успели погаснуть с прошлого прохода огня)
+    int len, cap;
+    unsigned char *listed; // Для каждой клетки карты: есть ли она в множестве
+    bool stale; // Огонь появлялся в обход множества, перед проходом огня оно собирается заново по всему полю
+} BurningSet;
+
+typedef struct {
+    int *cells; // Бомбы, которые взорвались в текущем проходе; их разбирает blasts_resolve после обхода
+    int len; // Пополняется атомарно: бомбы взрываются и в параллельном проходе
+    unsigned char *nearest; // Для клеток под взрывами: смещение от ближайшего центра (blast_offset), 0 – не задета
+} BlastQueue;
+
+typedef struct {
+    int *cells;
+    int len, cap;
+} FuseBucket;
+
+// Колесо таймеров: бомба, которой нечего делать, спит, пока не придёт её тик или рядом что-то не изменится
+typedef struct {
+    FuseBucket buckets[FUSE_WHEEL]; // Бомбы, которые взорвутся в тик с таким остатком от деления на FUSE_WHEEL
+    unsigned now; // Номер текущего тика (основного прохода)
+    pthread_mutex_t mtx; // Бомбы ставятся в колесо и из параллельного прохода
+} FuseWheel;
+
+typedef struct {
+    char magic[4]; // SAVE_MAGIC
+    uint32_t version; // SAVE_VERSION
+    uint32_t width, height;
+    uint32_t chunk_size; // CHUNK_SIZE программы, которая сохраняла
+    uint32_t reserved;
+    uint64_t seed; // Зерно симуляции
+    uint64_t passes; // Сколько проходов обновления было сделано
+} SaveHeader; // Заголовок файла сохранения. Числа записаны в порядке байтов машины, которая сохраняла
+
+// Сразу за заголовком лежит оглавление: по записи на каждый чанк, построчно. Данные чанка – это сначала
+// пары (длина серии - 1, тип клетки), которые построчно покрывают клетки чанка, а потом количество таймеров
+// бомб (uint16_t) и сами таймеры парами (номер клетки в чанке: uint16_t, таймер: int16_t)
+typedef struct {
+    uint64_t offset; // Где в файле лежат данные чанка
+    uint32_t size; // Сколько байт они занимают (0 – чанк пустой, и данных у него нет)
+    uint32_t flags; // SAVE_CHUNK_AWAKE
+} SaveChunk;
+
+enum {
+    CHUNK_READY, // Клетки чанка уже в плоскостях карты
+    CHUNK_PENDING, // Клетки чанка ещё лежат в файле сохранения
+    CHUNK_DECODING, // Чанк прямо сейчас распаковывает какой-то поток
+};
+
+// Открытое сохранение, из которого чанки распаковываются по мере надобности
+typedef struct {
+    const unsigned char *data; // Файл сохранения, отображённый в память
+    size_t size;
+    SaveHeader header;
+    const SaveChunk *dir; // Оглавление
+    int *state; // Состояние каждого чанка (CHUNK_READY и т. д.)
+    int pending; // Сколько чанков ещё не распаковано
+} ChunkLoader;
 
+// Клетки хранятся отдельными плоскостями, чтобы проходы по карте читали как можно меньше памяти
 typedef struct {
-    Cell *cells;
+    unsigned char *types; // Тип каждой клетки (CellType), по байту на клетку
+    unsigned char *updated; // Номер прохода (update_stamp), в котором клетку уже обновили и её надо пропустить
+    short *timers; // Таймеры клеток, нужны только бомбам: сколько тиков прошло или FUSE_QUEUED и тик взрыва
+    unsigned char *velocity; // Скорость падения клетки в клетках за тик (0 – не падает)
+    Chunk *chunks; // Чанки CHUNK_SIZE x CHUNK_SIZE, построчно
+    WaterList *water; // Живая вода для дополнительных проходов воды
+    BurningSet *burning; // Горящие клетки для прохода огня
+    BlastQueue *blasts; // Взрывы текущего прохода
+    FuseWheel *fuses; // Таймеры спящих бомб
+    long long *population; // Сколько клеток каждого типа на поле, вместе с нераспакованными чанками
+    ChunkLoader *loader; // Сохранение, чанки которого ещё не все распакованы (NULL, если таких нет)
     unsigned short width, height;
+    unsigned short chunks_w, chunks_h; // Количество чанков по горизонтали и вертикали
 } CellsMap;
 
+typedef enum {
+    EDIT_PAINT, // Залить прямоугольник клетками одного типа (стирание – это заливка пустотой)
+    EDIT_CLEAR, // Очистить всё поле
+    EDIT_SAVE, // Сохранить поле в save_path
+    EDIT_LOAD, // Загрузить поле из save_path
+    EDIT_PAUSE, // Поставить на паузу или снять с неё
+    EDIT_STEP, // Сделать один шаг во время паузы
+    EDIT_MENU, // Открыли (type = 1) или закрыли (type = 0) меню выбора клеток
+    EDIT_CURSOR, // Курсор сдвинули или сменили кисть: x0, y0 – положение, type – кисть, x1 – размер кисти
+} EditKind;
+
+typedef struct {
+    unsigned char kind; // EditKind
+    unsigned char type; // Тип клеток для EDIT_PAINT
+    int x0, y0, x1, y1; // Прямоугольник для EDIT_PAINT (включительно, может выходить за границы поля)
+} EditCommand; // Правка поля или другое действие, которое меняет ход симуляции
+
+// Кольцевой буфер правок от одного писателя (поток ввода) к одному читателю (поток симуляции)
+typedef struct {
+    EditCommand commands[EDIT_RING_SIZE];
+    unsigned head; // Сколько правок записано, меняет только писатель
+    unsigned tail; // Сколько правок применено, меняет только читатель
+} EditRing;
+
+typedef struct {
+    unsigned char *types; // Типы клеток видимой части поля, построчно
+    size_t cap;
+    int x, y, width, height; // Какая часть поля попала в снимок
+} Snapshot;
+
+// Тройной буфер снимков видимой части поля для отрисовки. Симуляция пишет в свой буфер и публикует его,
+// не дожидаясь отрисовки, а отрисовка забирает последний опубликованный снимок, когда ей удобно.
+// Буфер вместе со своей памятью принадлежит тому, у кого сейчас его номер
+typedef struct {
+    Snapshot slots[3];
+    int back; // Буфер, в который пишет симуляция
+    int front; // Буфер, который читает отрисовка
+    int ready; // Последний опубликованный буфер, вместе с SNAPSHOT_FRESH, если отрисовка его ещё не забрала
+} Snapshots;
+
+// Часть поля, которая видна на экране, в клетках поля. Меняется под curs_mtx
+struct {
+    int x, y; // Левый верхний угол
+    int width, height; // Сколько клеток помещается на экране
+} view;
+
+typedef struct {
+    char glyph;
+    unsigned char attr; // Цветовая пара, возможно, вместе с FRAME_PROTECT
+} FrameCell; // Символ на экране
+
+typedef enum {
+    BACKEND_NCURSES,
+    BACKEND_ANSI, // Кадр собирается в буфер escape-последовательностей и выводится одним write()
+} Backend;
+
+// Цвета песочницы. Из этой таблицы берутся и значения для init_color, и 24-битные цвета бэкенда ANSI
+const struct {
+    short color;
+    unsigned char r, g, b;
+} palette[] = {
+    {COLOR_YELLOW,      220,    217,    37},
+    {COLOR_BLUE,        36,     114,    200},
+    {COLOR_GRAY,        140,    140,    140},
+    {COLOR_DARKGRAY,    51,     51,     51},
+    {COLOR_BROWN,       102,    51,     0},
+    {COLOR_RED,         205,    49,     49},
+    {COLOR_ORANGE,      255,    127,    0},
+    {COLOR_GREEN,       13,     188,    121},
+    {COLOR_CYAN,        129,    160,    200},
+    {COLOR_CYAN_2,      97,     129,    167},
+    {COLOR_WHITE,       255,    255,    255},
+    {COLOR_BLACK,       0,      0,      0},
+};
+
+// Цветовые пары: номер пары, цвет символа и цвет фона
+const struct {
+    short pair, fg, bg;
+} color_pairs[] = {
+    {EMPTY,             COLOR_WHITE,    COLOR_BLACK},
+    {SAND,              COLOR_GRAY,     COLOR_YELLOW},
+    {WATER,             COLOR_WHITE,    COLOR_BLUE},
+    {STONE,             COLOR_GRAY,     COLOR_DARKGRAY},
+    {WOOD,              COLOR_WHITE,    COLOR_BROWN},
+    {ASH,               COLOR_DARKGRAY, COLOR_GRAY},
+    {FIRE,              COLOR_WHITE,    COLOR_RED},
+    {FIRE+CURSOR_ID,    COLOR_DARKGRAY, COLOR_ORANGE},
+    {BOMB,              COLOR_GRAY,     COLOR_GREEN},
+    {STEAM,             COLOR_GRAY,     COLOR_CYAN},
+    {STEAM+CURSOR_ID,   COLOR_GRAY,     COLOR_CYAN_2},
+    {CURSOR_ID,         COLOR_BLACK,    COLOR_WHITE},
+};
+
+#define PALETTE_SIZE (sizeof(palette)/sizeof(palette[0]))
+
+// Состояние бэкенда ANSI
+struct {
+    char *buf; // Заранее выделенный буфер, в который собирается весь кадр
+    size_t len, cap;
+    bool colors;
+    char fg_sgr[PALETTE_SIZE][16], bg_sgr[PALETTE_SIZE][16]; // Параметры SGR для каждого цвета палитры ("38;2;R;G;B")
+    signed char pair_fg[NUM_PAIRS], pair_bg[NUM_PAIRS]; // Номера цветов палитры для каждой пары
+    int row, col; // Где сейчас стоит курсор терминала (-1, если неизвестно)
+    int fg, bg; // Какие цвета палитры сейчас включены в терминале (-1, если неизвестно)
+    unsigned long long frames, bytes, writes; // Статистика вывода: frames – кадры, которые пришлось выводить
+    unsigned long long unchanged; // Кадры без изменений, на которые не понадобилось ни одного write()
+} ansi;
+
+// Последний выведенный на экран кадр (без рамки окна) и кадр, который собирается сейчас
+struct {
+    int width, height;
+    FrameCell *shown;
+    FrameCell *next;
+    unsigned char *skip; // Клетка поля уже нарисована эффектом соседа, и её надо пропустить при отрисовке
+} frame;
+
+typedef struct {
+    uint32_t s[4];
+} Rng; // Состояние генератора xoshiro128**
+
 typedef struct {
     int x, y;
     CellType brush;
@@ -112,344 +421,2521 @@ typedef struct {
     bool hide;
 } Cursor;
 
+_Thread_local Rng thread_rng; // Генератор потока, который обновляет карту
+_Thread_local long long population_delta[NUM_CELL_TYPES]; // Изменения населения, которые поток ещё не перенёс в карту
+Rng render_rng; // Отдельный генератор для эффектов отрисовки, чтобы они не влияли на симуляцию
+uint64_t sim_seed; // Зерно симуляции
+uint64_t update_passes = 0; // Сколько проходов обновления было сделано
+unsigned char update_stamp = 0; // Метка текущего прохода для плоскости updated, от 1 до 255
+int water_dispersion = DEFAULT_WATER_DISPERSION; // 0 – старый режим: вода ходит на клетку, но проходов воды за тик несколько
+
+// Заполняет состояние генератора из 64-битного зерна с помощью splitmix64
+void rng_seed(Rng *rng, uint64_t seed) {
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        rng->s[i] = (uint32_t)((z ^ (z >> 31)) >> 16);
+    }
+}
+
+static inline uint32_t rotl32(uint32_t x, int k) {
+    return (x << k) | (x >> (32 - k));
+}
+
+static inline uint32_t rng_next(Rng *rng) {
+    uint32_t *s = rng->s;
+    uint32_t result = rotl32(s[1] * 5, 7) * 9;
+    uint32_t t = s[1] << 9;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl32(s[3], 11);
+
+    return result;
+}
+
+// Случайное число в диапазоне 0..N-1 (умножением вместо медленного деления с остатком)
+static inline uint32_t rng_below(Rng *rng, uint32_t n) {
+    return (uint32_t)(((uint64_t)rng_next(rng) * n) >> 32);
+}
+
 // Перетасовывает массив чисел
 void shuffle(int array[], size_t len) {
     int t;
     for (size_t i = len-1; i > 0; i--) {
-        size_t j = rand() % (i+1);
-        //size_t j = random() * (i+1);
+        size_t j = rnd(i+1);
         swap(array[i], array[j], t);
     }
 }
 
-// Поворачивает массив ARRAY с длиной LEN на N позиций вправо
-void rotate(int array[], size_t len, int n) {
-    if (n == 0) return;
-    n = n % len;
+typedef enum {
+    ORDER_SHUFFLE, // Перемешанный раз за проход массив, который каждую строку поворачивается на случайный сдвиг
+    ORDER_SWEEP, // Слева направо и справа налево по очереди
+    ORDER_STRIDE, // Клетки идут с шагом, взаимно простым с длиной строки, от случайной: массив не нужен
+    ORDER_CHECKER, // Сначала клетки одного цвета шахматной доски, потом другого
+    NUM_ORDERS
+} OrderKind; // Порядок, в котором обходятся клетки строки
+
+const char *order_names[NUM_ORDERS] = {
+    [ORDER_SHUFFLE] = "shuffle", [ORDER_SWEEP] = "sweep", [ORDER_STRIDE] = "stride", [ORDER_CHECKER] = "checker",
+};
+
+OrderKind traversal_order = ORDER_SHUFFLE; // Порядок обхода для update (--order)
 
-    int t[n];
-    for (int i = 0; i < n; i++) {
-        t[i] = array[len-n + i];
+// Порядок обхода строк отрезка длиной LEN на один проход. Клетки отрезка считаются от его начала,
+// а место – это номер клетки в очереди текущей строки
+typedef struct {
+    OrderKind kind;
+    int len;
+    int *cells, *places; // ORDER_SHUFFLE: перемешанные клетки и место каждой клетки в этом массиве
+    int shift; // ORDER_SHUFFLE и ORDER_STRIDE: сдвиг строки, ORDER_SWEEP и ORDER_CHECKER: чётность строки
+    int step, inverse; // ORDER_STRIDE: шаг и обратный к нему по модулю len
+} Traversal;
+
+// Начинает проход по отрезку длиной LEN. CELLS и PLACES по LEN чисел нужны только ORDER_SHUFFLE
+void traversal_start(Traversal *t, int len, int *cells, int *places) {
+    t->kind = traversal_order;
+    t->len = len;
+    t->cells = cells;
+    t->places = places;
+    t->shift = 0;
+
+    if (t->kind == ORDER_SHUFFLE) {
+        for (int i = 0; i < len; i++)
+            cells[i] = i;
+        shuffle(cells, len);
+        for (int i = 0; i < len; i++)
+            places[cells[i]] = i;
+    } else if (t->kind == ORDER_STRIDE) {
+        // Случайный шаг, взаимно простой с длиной, и обратный к нему расширенным алгоритмом Евклида
+        int a, b, x0, x1, q, r;
+        do {
+            t->step = (len > 1 ? 1 + rnd(len-1) : 1);
+            a = t->step, b = len, x0 = 1, x1 = 0;
+            while (b != 0) {
+                q = a / b;
+                r = a - q*b, a = b, b = r;
+                r = x0 - q*x1, x0 = x1, x1 = r;
+            }
+        } while (a != 1);
+        t->inverse = (x0 % len + len) % len;
     }
-    for (int i = len-1; i >= n; i--) {
-        array[i] = array[i-n];
+}
+
+// Переходит к следующей строке. PARITY – чётность строки для ORDER_SWEEP и ORDER_CHECKER
+static inline void traversal_row(Traversal *t, int parity) {
+    switch (t->kind) {
+    case ORDER_SHUFFLE:
+        t->shift = (t->shift + rnd(t->len)) % t->len;
+        break;
+    case ORDER_STRIDE:
+        t->shift = rnd(t->len);
+        break;
+    default:
+        t->shift = parity & 1;
+        break;
     }
-    memcpy(array, t, n*sizeof(int));
 }
 
-pthread_mutex_t map_mtx;
-pthread_mutex_t curs_mtx;
+// Место клетки K в очереди текущей строки
+static inline int traversal_place(const Traversal *t, int k) {
+    int p, first;
+    switch (t->kind) {
+    case ORDER_SHUFFLE:
+        p = t->places[k] + t->shift;
+        return (p < t->len ? p : p - t->len);
+    case ORDER_SWEEP:
+        return (t->shift ? t->len-1 - k : k);
+    case ORDER_STRIDE:
+        return (int)((long long)t->inverse * (k - t->shift + t->len) % t->len);
+    default:
+        first = (t->len + 1 - t->shift) / 2; // Сколько клеток первого цвета
+        return ((k + t->shift) & 1 ? first + k/2 : k/2);
+    }
+}
 
-void render(WINDOW *window, CellsMap map, Cursor cursor, CellInfo cells_info[], bool square_pixels, bool simple_fire, bool simple_steam) {
-    pthread_mutex_lock(&map_mtx);
-    pthread_mutex_lock(&curs_mtx);
+// Клетка, которая стоит на месте P очереди текущей строки
+static inline int traversal_at(const Traversal *t, int p) {
+    int i, first;
+    switch (t->kind) {
+    case ORDER_SHUFFLE:
+        i = p - t->shift;
+        return t->cells[i >= 0 ? i : i + t->len];
+    case ORDER_SWEEP:
+        return (t->shift ? t->len-1 - p : p);
+    case ORDER_STRIDE:
+        return (int)(((long long)t->step * p + t->shift) % t->len);
+    default:
+        first = (t->len + 1 - t->shift) / 2;
+        return (p < first ? 2*p + t->shift : 2*(p - first) + 1 - t->shift);
+    }
+}
 
-    int render_height, render_width;
-    render_height = (MAPH < map.height ? MAPH : map.height);
-    if (square_pixels) {
-        render_width = (MAPW/2 < map.width ? MAPW/2 : map.width);
+// Атомарно уменьшает *P до V, если V меньше
+static inline void atomic_min(int *p, int v) {
+    int cur = __atomic_load_n(p, __ATOMIC_RELAXED);
+    while (v < cur && !__atomic_compare_exchange_n(p, &cur, v, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Атомарно увеличивает *P до V, если V больше
+static inline void atomic_max(int *p, int v) {
+    int cur = __atomic_load_n(p, __ATOMIC_RELAXED);
+    while (v > cur && !__atomic_compare_exchange_n(p, &cur, v, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Усыпляет все чанки карты и очищает их грязные прямоугольники
+void map_sleep_all(CellsMap map) {
+    for (int i = 0; i < map.chunks_w*map.chunks_h; i++) {
+        map.chunks[i] = (Chunk){false, INT_MAX, INT_MAX, -1, -1, INT_MAX, INT_MAX, -1, -1};
+    }
+}
+
+// Распаковывает чанк CHUNK_IDX из сохранения в плоскости карты. Пустые серии пропускаются,
+// чтобы не занимать память под пустоту
+void chunk_decode(CellsMap map, int chunk_idx) {
+    const SaveChunk *entry = &map.loader->dir[chunk_idx];
+    const unsigned char *p = map.loader->data + entry->offset;
+    const unsigned char *end = p + entry->size;
+
+    int x0 = (chunk_idx % map.chunks_w) * CHUNK_SIZE;
+    int y0 = (chunk_idx / map.chunks_w) * CHUNK_SIZE;
+    int w = (map.width - x0 < CHUNK_SIZE ? map.width - x0 : CHUNK_SIZE);
+    int h = (map.height - y0 < CHUNK_SIZE ? map.height - y0 : CHUNK_SIZE);
+
+    int cell = 0;
+    for (; cell < w*h && p+2 <= end; p += 2) {
+        int run = p[0] + 1;
+        unsigned char type = (p[1] < NUM_CELL_TYPES ? p[1] : EMPTY);
+        for (; run > 0 && cell < w*h; run--, cell++) {
+            if (type != EMPTY)
+                map.types[(y0 + cell/w)*map.width + x0 + cell%w] = type;
+        }
+    }
+
+    uint16_t timers = 0;
+    if (p+2 <= end) {
+        memcpy(&timers, p, 2);
+        p += 2;
+    }
+    for (; timers > 0 && p+4 <= end; timers--, p += 4) {
+        uint16_t cell;
+        int16_t timer;
+        memcpy(&cell, p, 2);
+        memcpy(&timer, p+2, 2);
+        if (cell < w*h)
+            map.timers[(y0 + cell/w)*map.width + x0 + cell%w] = timer;
+    }
+}
+
+// Добавляет к COUNTS непустые клетки чанка CHUNK_IDX из сохранения, не распаковывая его
+void chunk_count(CellsMap map, int chunk_idx, long long counts[NUM_CELL_TYPES]) {
+    const SaveChunk *entry = &map.loader->dir[chunk_idx];
+    const unsigned char *p = map.loader->data + entry->offset;
+    const unsigned char *end = p + entry->size;
+
+    int x0 = (chunk_idx % map.chunks_w) * CHUNK_SIZE;
+    int y0 = (chunk_idx / map.chunks_w) * CHUNK_SIZE;
+    int w = (map.width - x0 < CHUNK_SIZE ? map.width - x0 : CHUNK_SIZE);
+    int h = (map.height - y0 < CHUNK_SIZE ? map.height - y0 : CHUNK_SIZE);
+
+    for (int cell = 0; cell < w*h && p+2 <= end; p += 2) {
+        int run = (p[0] + 1 < w*h - cell ? p[0] + 1 : w*h - cell);
+        if (p[1] < NUM_CELL_TYPES && p[1] != EMPTY)
+            counts[p[1]] += run;
+        cell += run;
+    }
+}
+
+// Переносит изменения населения, которые накопил поток, в карту
+void population_flush(CellsMap map) {
+    for (int i = 0; i < NUM_CELL_TYPES; i++) {
+        if (population_delta[i] != 0)
+            __atomic_add_fetch(&map.population[i], population_delta[i], __ATOMIC_RELAXED);
+        population_delta[i] = 0;
+    }
+}
+
+// Считает население проходом по всему полю (нераспакованные чанки сохранения – как пустые)
+void population_scan(CellsMap map, long long counts[NUM_CELL_TYPES]) {
+    for (int i = 0; i < NUM_CELL_TYPES; i++)
+        counts[i] = 0;
+    for (size_t i = 0; i < (size_t)map.width*map.height; i++)
+        counts[map.types[i]]++;
+}
+
+// Распаковывает чанк, если он ещё лежит в сохранении. Если его уже распаковывает другой поток, дожидается его
+void map_decode_chunk(CellsMap map, int chunk_idx) {
+    int *state = &map.loader->state[chunk_idx];
+    int expected = CHUNK_PENDING;
+    if (__atomic_load_n(state, __ATOMIC_ACQUIRE) == CHUNK_READY)
+        return;
+
+    if (__atomic_compare_exchange_n(state, &expected, CHUNK_DECODING, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        chunk_decode(map, chunk_idx);
+        __atomic_store_n(state, CHUNK_READY, __ATOMIC_RELEASE);
+        __atomic_sub_fetch(&map.loader->pending, 1, __ATOMIC_RELAXED);
     } else {
-        render_width = (MAPW < map.width ? MAPW : map.width);
+        while (__atomic_load_n(state, __ATOMIC_ACQUIRE) != CHUNK_READY);
     }
+}
 
-    for (int y = 0; y < render_height; y++) {
-        for (int x = 0; x < render_width; x++) {
-            int current = y*map.width + x;
+// Распаковывает все чанки сохранения, которые задевает прямоугольник клеток
+void map_decode_rect(CellsMap map, int x0, int y0, int x1, int y1) {
+    if (map.loader == NULL)
+        return;
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > map.width-1) x1 = map.width-1;
+    if (y1 > map.height-1) y1 = map.height-1;
 
-            if (map.cells[current].skip_render) {
-                map.cells[current].skip_render = false;
-                continue;
-            }
-            wmove(window, y + 1, x*(1+square_pixels) + 1);
-            CellInfo current_cell_info = cells_info[map.cells[current].type];
-            if (incursor(x, y, cursor)) {
-                if (map.cells[current].type == EMPTY) {
-                    for (int i = 0; i <= square_pixels; i++)
-                        waddch(window, CURSOR_SPRITE | COLOR_PAIR(CURSOR_ID));
-                } else {
-                    for (int i = 0; i <= square_pixels; i++)
-                        waddch(window, current_cell_info.sprites[0] | COLOR_PAIR(CURSOR_ID));
-                }
-            } else {
-                for (int i = 0; i <= square_pixels; i++) {
-                    if (map.cells[current].type == FIRE)
-                        waddch(window, cells_info[FIRE].sprites[rand() % 2] | COLOR_PAIR(cells_info[FIRE].colors[rand() % 2]));
-                    else
-                        waddch(window, current_cell_info.sprites[0] | A_PROTECT | COLOR_PAIR(current_cell_info.colors[0]));
-                }
+    for (int cy = y0 / CHUNK_SIZE; cy <= y1 / CHUNK_SIZE && y0 <= y1; cy++) {
+        for (int cx = x0 / CHUNK_SIZE; cx <= x1 / CHUNK_SIZE && x0 <= x1; cx++)
+            map_decode_chunk(map, cy*map.chunks_w + cx);
+    }
+}
 
-                if (map.cells[current].type == FIRE && !simple_fire) {
-                    //int neighbors[8] = {current-map.width-1, current-map.width, current-map.width+1, current-1, current+1, current+map.width-1, current+map.width, current+map.width+1};
-                    int neighbors_x[8] = {x-1, x, x+1, x-1, x+1, x-1, x, x+1};
-                    int neighbors_y[8] = {y-1, y-1, y-1, y, y, y+1, y+1, y+1};
-                    
-                    for (int i = 0; i < 8; i++) {
-                        if (neighbors_x[i] >= 0 && neighbors_x[i] <= (render_width-1) && \
-                            neighbors_y[i] >= 0 && neighbors_y[i] <= (render_height-1) && \
-                            (rand() % 10 < 3))
-                        {
-                            map.cells[neighbors_y[i]*map.width + neighbors_x[i]].skip_render = true;
-                            wmove(window, neighbors_y[i] + 1, neighbors_x[i]*(1+square_pixels) + 1);
-                            if (!incursor(neighbors_x[i], neighbors_y[i], cursor)) {
-                                for (int i = 0; i <= square_pixels; i++)
-                                    waddch(window, cells_info[FIRE].sprites[rand() % 2] | COLOR_PAIR(cells_info[FIRE].colors[rand() % 2]));
-                            }
-                        }
-                    }
-                } else if (map.cells[current].type == STEAM && !simple_steam) {
-                    int neighbors_x[4] = {x, x+1, x, x-1};
-                    int neighbors_y[4] = {y-1, y, y+1, y};
-                    for (int i = 0; i < 4; i++) {
-                        if (neighbors_x[i] >= 0 && neighbors_x[i] <= (render_width-1) && \
-                            neighbors_y[i] >= 0 && neighbors_y[i] <= (render_height-1))
-                        {
-                            if (!incursor(neighbors_x[i], neighbors_y[i], cursor)) {
-                                map.cells[neighbors_y[i]*map.width + neighbors_x[i]].skip_render = true;
-                                wmove(window, neighbors_y[i] + 1, neighbors_x[i]*(1+square_pixels) + 1);
-                                for (int i = 0; i <= square_pixels; i++)
-                                    waddch(window, cells_info[STEAM].sprites[0] | COLOR_PAIR(cells_info[STEAM].colors[1]));
-                            }
-                        }
-                    }
-                }
+// Помечает прямоугольник клеток как изменившийся: он будет обработан в оставшейся части текущего тика
+// и в следующем тике, а задетые чанки просыпаются
+void map_touch_rect(CellsMap map, int x0, int y0, int x1, int y1) {
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > map.width-1) x1 = map.width-1;
+    if (y1 > map.height-1) y1 = map.height-1;
+    if (x0 > x1 || y0 > y1) return;
+
+    for (int cy = y0 / CHUNK_SIZE; cy <= y1 / CHUNK_SIZE; cy++) {
+        for (int cx = x0 / CHUNK_SIZE; cx <= x1 / CHUNK_SIZE; cx++) {
+            Chunk *chunk = &map.chunks[cy*map.chunks_w + cx];
+            int ix0 = (x0 > cx*CHUNK_SIZE ? x0 : cx*CHUNK_SIZE);
+            int iy0 = (y0 > cy*CHUNK_SIZE ? y0 : cy*CHUNK_SIZE);
+            int ix1 = (x1 < (cx+1)*CHUNK_SIZE-1 ? x1 : (cx+1)*CHUNK_SIZE-1);
+            int iy1 = (y1 < (cy+1)*CHUNK_SIZE-1 ? y1 : (cy+1)*CHUNK_SIZE-1);
+
+            // В параллельном режиме соседний чанк могут одновременно будить два потока
+            atomic_min(&chunk->x0, ix0);
+            atomic_min(&chunk->y0, iy0);
+            atomic_max(&chunk->x1, ix1);
+            atomic_max(&chunk->y1, iy1);
+
+            atomic_min(&chunk->nx0, ix0);
+            atomic_min(&chunk->ny0, iy0);
+            atomic_max(&chunk->nx1, ix1);
+            atomic_max(&chunk->ny1, iy1);
+
+            if (!chunk->awake) {
+                // Клетки чанка достают не дальше BLAST_REACH, то есть только до соседних чанков:
+                // они должны быть распакованы раньше, чем их кто-то прочитает
+                if (map.loader != NULL)
+                    map_decode_rect(map, (cx-1)*CHUNK_SIZE, (cy-1)*CHUNK_SIZE, (cx+2)*CHUNK_SIZE-1, (cy+2)*CHUNK_SIZE-1);
+                __atomic_store_n(&chunk->awake, true, __ATOMIC_RELAXED);
             }
         }
-        wnoutrefresh(window);
     }
+}
+
+// Начинает новый тик: накопленные грязные прямоугольники становятся текущими,
+// а чанки, в которых ничего не изменилось, засыпают
+void map_begin_tick(CellsMap map) {
+    for (int i = 0; i < map.chunks_w*map.chunks_h; i++) {
+        Chunk *chunk = &map.chunks[i];
+        chunk->x0 = chunk->nx0;
+        chunk->y0 = chunk->ny0;
+        chunk->x1 = chunk->nx1;
+        chunk->y1 = chunk->ny1;
+        chunk->nx0 = chunk->ny0 = INT_MAX;
+        chunk->nx1 = chunk->ny1 = -1;
+        chunk->awake = (chunk->x0 <= chunk->x1);
+    }
+}
 
-    pthread_mutex_unlock(&map_mtx);
+// Выделяет обнулённую плоскость клеток. Страницы берутся у системы лениво, поэтому части огромного мира,
+// которых ни разу не касались, не занимают памяти
+void *plane_alloc(size_t size) {
+    #ifdef _WIN32
+        return calloc(size, 1);
+    #else
+        void *plane = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        return (plane == MAP_FAILED ? NULL : plane);
+    #endif
+}
 
-    CellInfo brush_info = cells_info[cursor.brush];
+void plane_free(void *plane, size_t size) {
+    #ifdef _WIN32
+        (void)size;
+        free(plane);
+    #else
+        if (plane != NULL)
+            munmap(plane, size);
+    #endif
+}
 
-    wmove(window, 1, 1);
-    waddch(window, brush_info.sprites[0] | COLOR_PAIR(brush_info.colors[0]));
+// Обнуляет плоскость, отдавая её страницы обратно системе вместо того, чтобы записывать нули в каждую
+void plane_zero(void *plane, size_t size) {
+    #ifdef _WIN32
+        memset(plane, 0, size);
+    #else
+        madvise(plane, size, MADV_DONTNEED);
+    #endif
+}
 
-    char brushsize_str[3];
-    sprintf(brushsize_str, "%d", (cursor.brush_size <= 99 ? cursor.brush_size : 99));
-    pthread_mutex_unlock(&curs_mtx);
-    wmove(window, 1, 3);
-    waddstr(window, brushsize_str);
+// Выделяет пустую карту WIDTH x HEIGHT со всеми вспомогательными структурами
+bool map_create(CellsMap *map, int width, int height) {
+    *map = (CellsMap){.width = width, .height = height};
+    if ((long long)width*height > INT_MAX) // Индексы клеток должны помещаться в int
+        return false;
+    map->chunks_w = (width + CHUNK_SIZE-1) / CHUNK_SIZE;
+    map->chunks_h = (height + CHUNK_SIZE-1) / CHUNK_SIZE;
+
+    map->types = plane_alloc(width*height);
+    map->updated = plane_alloc(width*height);
+    map->timers = plane_alloc(width*height * sizeof(short));
+    map->velocity = plane_alloc(width*height);
+    map->chunks = malloc(map->chunks_w*map->chunks_h * sizeof(Chunk));
+    map->water = calloc(1, sizeof(WaterList));
+    if (map->water != NULL) {
+        map->water->listed = plane_alloc(width*height);
+        map->water->row_start = malloc((height+1) * sizeof(int));
+    }
+    map->burning = calloc(1, sizeof(BurningSet));
+    if (map->burning != NULL) {
+        map->burning->listed = plane_alloc(width*height);
+        map->burning->stale = true; // Сценарии пишут клетки напрямую
+    }
+    map->blasts = calloc(1, sizeof(BlastQueue));
+    if (map->blasts != NULL) {
+        map->blasts->cells = plane_alloc(width*height * sizeof(int)); // Больше, чем клеток, бомб не бывает
+        map->blasts->nearest = plane_alloc(width*height);
+    }
+    map->population = calloc(NUM_CELL_TYPES, sizeof(long long));
+    if (map->population != NULL)
+        map->population[EMPTY] = (long long)width*height;
+    map->fuses = calloc(1, sizeof(FuseWheel));
+    if (map->fuses != NULL)
+        pthread_mutex_init(&map->fuses->mtx, NULL);
 
-    wmove(window, 1, 6);
-    waddstr(window, brush_info.name);
+    if (map->types == NULL || map->updated == NULL || map->timers == NULL || map->velocity == NULL || \
+        map->chunks == NULL || map->water == NULL || map->water->listed == NULL || map->water->row_start == NULL || \
+        map->burning == NULL || map->burning->listed == NULL || \
+        map->blasts == NULL || map->blasts->cells == NULL || map->blasts->nearest == NULL || map->fuses == NULL || \
+        map->population == NULL)
+    {
+        return false;
+    }
 
-    wnoutrefresh(window);
-    doupdate();
+    map_sleep_all(*map);
+    return true;
 }
 
-void update(CellsMap map, bool only_water) {
-    int order[map.width]; // Массив с порядком обработки ячеек
-    for (int i = 0; i < map.width; i++)
-        order[i] = i;
-    shuffle(order, map.width); // Перемешивание массива, чтобы ячейки обрабатывались в случайном порядке
-    
-    pthread_mutex_lock(&map_mtx);
+// Закрывает сохранение и освобождает память, которую заняли его чанки
+void loader_close(ChunkLoader *loader) {
+    if (loader == NULL)
+        return;
+    #ifdef _WIN32
+        free((void *)loader->data);
+    #else
+        if (loader->data != NULL)
+            munmap((void *)loader->data, loader->size);
+    #endif
+    free(loader->state);
+    free(loader);
+}
 
-    for (int y = map.height-1; y >= 0; y--) { // y - координата ячейки по Y
-        rotate(order, map.width, rand() % map.width);
-        for (int i = 0; i < map.width; i++) {
-            int x = order[i]; // Координата ячейки по x
-            int current = y*map.width + x;
-            if (map.cells[current].skip_update) {
-                map.cells[current].skip_update = false;
-                continue;
-            }
-            if (only_water && map.cells[current].type != WATER)
-                continue;
-            
-            int top = (y-1)*map.width + x;
-            int bottom = (y+1)*map.width + x;
-            Cell t;
+// Освобождает всё, что выделила map_create (в том числе и недовыделенную карту)
+void map_destroy(CellsMap *map) {
+    size_t size = map->width*map->height;
+    plane_free(map->types, size);
+    plane_free(map->updated, size);
+    plane_free(map->timers, size * sizeof(short));
+    plane_free(map->velocity, size);
+    free(map->chunks);
+    if (map->water != NULL) {
+        free(map->water->cells);
+        free(map->water->sorted);
+        plane_free(map->water->listed, size);
+        free(map->water->row_start);
+        free(map->water);
+    }
+    if (map->burning != NULL) {
+        free(map->burning->cells);
+        plane_free(map->burning->listed, size);
+        free(map->burning);
+    }
+    if (map->blasts != NULL) {
+        plane_free(map->blasts->cells, size * sizeof(int));
+        plane_free(map->blasts->nearest, size);
+        free(map->blasts);
+    }
+    if (map->fuses != NULL) {
+        for (int i = 0; i < FUSE_WHEEL; i++)
+            free(map->fuses->buckets[i].cells);
+        pthread_mutex_destroy(&map->fuses->mtx);
+        free(map->fuses);
+    }
+    free(map->population);
+    loader_close(map->loader);
+    *map = (CellsMap){0};
+}
 
-            int movements[8] = {0}; // Массив индексов клеток, куда можно переместиться
-            int j = 0;
+// Сколько тиков прошло с тех пор, как бомба IDX начала гореть
+static inline int fuse_elapsed(CellsMap map, int idx) {
+    if (!(map.timers[idx] & FUSE_QUEUED))
+        return map.timers[idx];
+    return BOMB_FUSE - ((map.timers[idx] - map.fuses->now) & FUSE_TICK_MASK);
+}
 
-            switch (map.cells[current].type) {
-            case EMPTY:
-            case WOOD:
-            case STONE:
-                break;
-            case ASH:
-            case SAND:
-                if (y >= map.height-1) {
-                    break;
-                }
+// Ставит бомбу IDX в колесо до тика, когда она взорвётся сама
+void fuse_schedule(CellsMap map, int idx) {
+    FuseWheel *fuses = map.fuses;
+    unsigned tick = fuses->now + BOMB_FUSE - map.timers[idx];
+    FuseBucket *bucket = &fuses->buckets[tick % FUSE_WHEEL];
 
-                if (canmove(bottom)) {
-                    swap(map.cells[current], map.cells[bottom], t);
-                } else if (canmovel(bottom - 1, x) && canmover(bottom + 1, x)) {
-                    int idx = bottom + (rand() % 2 ? 1 : -1);
-                    swap(map.cells[current], map.cells[idx], t);
-                } else if (canmovel(bottom - 1, x) && !canmover(bottom + 1, x)) {
-                    swap(map.cells[current], map.cells[bottom - 1], t);
-                } else if (!canmovel(bottom - 1, x) && canmover(bottom + 1, x)) {
-                    swap(map.cells[current], map.cells[bottom + 1], t);
-                }
-                break;
-            case WATER:
-                if (y < map.height-1 && watercanmove(bottom)) {
-                    swap(map.cells[current], map.cells[bottom], t);
-                    if (map.cells[current].type == STEAM)
-                        map.cells[current].skip_update = true;
-                } else if (watercanmovel(current - 1, x) && watercanmover(current + 1, x) && (y == map.height-1 || (!watercanmovel(bottom - 1, x) && !watercanmover(bottom + 1, x)))) {
-                    int idx = current + (rand() % 2 ? 1 : -1);
-                    swap(map.cells[current], map.cells[idx], t);
-                } else if (watercanmovel(current - 1, x) && !watercanmover(current + 1, x) && (y == map.height-1 || (!watercanmovel(bottom - 1, x) && !watercanmover(bottom + 1, x)))) {
-                    swap(map.cells[current], map.cells[current - 1], t);
-                } else if (!watercanmovel(current - 1, x) && watercanmover(current + 1, x) && (y == map.height-1 || (!watercanmovel(bottom - 1, x) && !watercanmover(bottom + 1, x)))) {
-                    swap(map.cells[current], map.cells[current + 1], t);
-                } else if (y < map.height-1 && watercanmovel(bottom - 1, x) && watercanmover(bottom + 1, x)) {
-                    int idx = bottom + (rand() % 2 ? 1 : -1);
-                    swap(map.cells[current], map.cells[idx], t);
-                    if (map.cells[current].type == STEAM)
-                        map.cells[current].skip_update = true;
-                } else if (y < map.height-1 && watercanmovel(bottom - 1, x) && !watercanmover(bottom + 1, x)) {
-                    swap(map.cells[current], map.cells[bottom - 1], t);
-                    if (map.cells[current].type == STEAM)
-                        map.cells[current].skip_update = true;
-                } else if (y < map.height-1 && !watercanmovel(bottom - 1, x) && watercanmover(bottom + 1, x)) {
-                    swap(map.cells[current], map.cells[bottom + 1], t);
-                    if (map.cells[current].type == STEAM)
-                        map.cells[current].skip_update = true;
-                }
-                break;
-            case STEAM:
-                if (rand() % 5 > 0) {
-                    break;
-                }
+    pthread_mutex_lock(&fuses->mtx);
+    if (bucket->len == bucket->cap) {
+        int cap = (bucket->cap ? bucket->cap * 2 : 256);
+        int *cells = realloc(bucket->cells, cap * sizeof(int));
+        if (cells == NULL) { // Не хватило памяти: бомба остаётся тикать каждый тик, как раньше
+            pthread_mutex_unlock(&fuses->mtx);
+            map.timers[idx]++;
+            keep_awake(map, idx % map.width, idx / map.width);
+            return;
+        }
+        bucket->cells = cells;
+        bucket->cap = cap;
+    }
+    bucket->cells[bucket->len++] = idx;
+    pthread_mutex_unlock(&fuses->mtx);
+    map.timers[idx] = FUSE_QUEUED | (tick & FUSE_TICK_MASK);
+}
 
-                if (y > 0) {
-                    if (steamcanmove(top)) movements[j++] = top;
-                    if (steamcanmovel(top - 1, x)) movements[j++] = top-1;
-                    if (steamcanmover(top + 1, x)) movements[j++] = top+1;
-                }
+// Начинает новый тик колеса и будит бомбы, чей тик пришёл. Бомбы, которые успели взорваться, сгореть
+// или переставиться заново, пропускаются
+void fuses_advance(CellsMap map) {
+    FuseWheel *fuses = map.fuses;
+    fuses->now++;
+    FuseBucket *bucket = &fuses->buckets[fuses->now % FUSE_WHEEL];
+    short due = FUSE_QUEUED | (fuses->now & FUSE_TICK_MASK);
+    for (int i = 0; i < bucket->len; i++) {
+        int idx = bucket->cells[i];
+        if (map.types[idx] == BOMB && map.timers[idx] == due)
+            keep_awake(map, idx % map.width, idx / map.width);
+    }
+    bucket->len = 0;
+}
 
-                if (steamcanmovel(current - 1, x)) movements[j++] = current-1;
-                if (steamcanmover(current + 1, x)) movements[j++] = current+1;
+// Добавляет горящую клетку в множество огня, если её там ещё нет
+void burning_add(CellsMap map, int idx) {
+    BurningSet *burning = map.burning;
+    if (burning->listed[idx])
+        return;
 
-                if (y < map.height-1 && rand() % 2) {
-                    if (steamcanmove(bottom)) movements[j++] = bottom;
-                    if (steamcanmovel(bottom - 1, x)) movements[j++] = bottom - 1;
-                    if (steamcanmover(bottom + 1, x)) movements[j++] = bottom + 1;
-                }
+    if (burning->len == burning->cap) {
+        int cap = (burning->cap ? burning->cap*2 : 256);
+        int *cells = realloc(burning->cells, cap * sizeof(int));
+        if (cells == NULL) { // Не хватило памяти: перед следующим проходом огня множество соберётся по всему полю
+            burning->stale = true;
+            return;
+        }
+        burning->cells = cells;
+        burning->cap = cap;
+    }
+    burning->cells[burning->len++] = idx;
+    burning->listed[idx] = true;
+}
 
-                if (j > 0) {
-                    j *= random(); // Случайное число в диапазоне 0..j
-                    swap(map.cells[current], map.cells[movements[j]], t);
-                    if (movements[j] > bottom-1)
-                        map.cells[movements[j]].skip_update = true;
-                    if (movements[j] - map.width >= 0)
-                        map.cells[movements[j] - map.width].skip_update = true;
-                }
+// Добавляет в множество огня все горящие клетки прямоугольника
+void burning_scan(CellsMap map, int x0, int y0, int x1, int y1) {
+    for (int y = y0; y <= y1; y++) {
+        for (int x = x0; x <= x1; x++) {
+            if (cell_props[map.types[y*map.width + x]].flags & CELL_BURNING)
+                burning_add(map, y*map.width + x);
+        }
+    }
+}
 
-                break;
-            case FIRE:
-                if (y > 0) {
-                    if (map.cells[top].type == WATER) goto fireclear;
-                    else if (map.cells[top].type == WOOD) movements[j++] = top;
-                    if (x > 0 && map.cells[top - 1].type == WATER) goto fireclear;
-                    else if (x > 0 && map.cells[top - 1].type == WOOD) movements[j++] = top-1;
-                    if (x < map.width-1 && map.cells[top + 1].type == WATER) goto fireclear;
-                    else if (x < map.width-1 && map.cells[top + 1].type == WOOD) movements[j++] = top+1;
-                }
+// Очищает множество огня
+void burning_clear(CellsMap map) {
+    BurningSet *burning = map.burning;
+    for (int i = 0; i < burning->len; i++)
+        burning->listed[burning->cells[i]] = false;
+    burning->len = 0;
+    burning->stale = false;
+}
 
-                if (x > 0 && map.cells[current - 1].type == WATER) goto fireclear;
-                else if (x > 0 && map.cells[current - 1].type == WOOD) movements[j++] = current-1;
-                if (x < map.width-1 && map.cells[current + 1].type == WATER) goto fireclear;
-                else if (x < map.width-1 && map.cells[current + 1].type == WOOD) movements[j++] = current+1;
-                
-                if (y < map.height-1) {
-                    if (map.cells[bottom].type == WATER) goto fireclear;
-                    else if (map.cells[bottom].type == WOOD) movements[j++] = bottom;
-                    if (x > 0 && map.cells[bottom - 1].type == WATER) goto fireclear;
-                    else if (x > 0 && map.cells[bottom - 1].type == WOOD) movements[j++] = bottom - 1;
-                    if (x < map.width-1 && map.cells[bottom + 1].type == WATER) goto fireclear;
-                    else if (x < map.width-1 && map.cells[bottom + 1].type == WOOD) movements[j++] = bottom + 1;
-                }
-                if (j > 0) {
-                    float r = random();
-
-                    if (r > 0.15f)
-                        break;
-
-                    j *= random(); // Случайное число в диапазоне 0..j
-                    map.cells[movements[j]].type = FIRE;
-                    if (movements[j] > bottom-1) // Пропуск обновления новой ячейки огня, если она будет ещё раз обрабатываться в цикле за этот кадр
-                        map.cells[movements[j]].skip_update = true;
-                    if (r < 0.06f) {
-                        map.cells[current].type = (r < 0.04f) ? ASH : FIRE;
-                    } else {
-                        map.cells[current].type = EMPTY;
-                    }
-                } else {
-                    fireclear:
-                    map.cells[current].type = EMPTY;
+// Кодирует чанк CHUNK_IDX в BUF в формате сохранения и возвращает размер данных (0, если чанк пустой).
+// В LIT кладёт, есть ли в чанке горящие бомбы
+size_t chunk_encode(CellsMap map, int chunk_idx, unsigned char *buf, bool *lit) {
+    int x0 = (chunk_idx % map.chunks_w) * CHUNK_SIZE;
+    int y0 = (chunk_idx / map.chunks_w) * CHUNK_SIZE;
+    int w = (map.width - x0 < CHUNK_SIZE ? map.width - x0 : CHUNK_SIZE);
+    int h = (map.height - y0 < CHUNK_SIZE ? map.height - y0 : CHUNK_SIZE);
+    size_t len = 0;
+    bool empty = true;
 
-                    int neighbors_x[8] = {x-1, x, x+1, x-1, x+1, x-1, x, x+1};
-                    int neighbors_y[8] = {y-1, y-1, y-1, y, y, y+1, y+1, y+1};
-                    for (int i = 0; i < 8; i++) {
-                        if (neighbors_x[i] >= 0 && neighbors_x[i] <= (map.width-1) && \
-                            neighbors_y[i] >= 0 && neighbors_y[i] <= (map.height-1) && \
-                            map.cells[neighbors_y[i]*map.width + neighbors_x[i]].type == WATER)
-                        {
-                            map.cells[neighbors_y[i]*map.width + neighbors_x[i]].type = STEAM;
-                        }
-                    }
-                }
-                break;
-            case BOMB:
-                if (y > 0) {
-                    if (map.cells[top].type == FIRE) goto boom;
-                    if (x > 0 && map.cells[top - 1].type == FIRE) goto boom;
-                    if (x < map.width-1 && map.cells[top + 1].type == FIRE) goto boom;
-                }
-                if (x > 0 && map.cells[current - 1].type == FIRE) goto boom;
-                if (x < map.width-1 && map.cells[current + 1].type == FIRE) goto boom;
-                if (y < map.height-1) {
-                    if (map.cells[bottom].type == FIRE) goto boom;
-                    if (x > 0 && map.cells[bottom - 1].type == FIRE) goto boom;
-                    if (x < map.width-1 && map.cells[bottom + 1].type == FIRE) goto boom;
-                }
-                if (map.cells[current].timer >= 50) {
-                    boom:
-                    for (int cy = y-4; cy <= y+4; cy++) {
-                        for (int cx = x-4; cx <= x+4; cx++) {
-                            if (cx >= 0 && cx <= (map.width-1) && cy >= 0 && cy <= (map.height-1)) {
-                                if (rand() % 6 == 0) continue;
-                                
-                                int ncurrent = cy*map.width + cx;
-
-                                if (cx >= x-1 && cx <= x+1 && cy >= y-1 && cy <= y+1) {
-                                    map.cells[ncurrent].type = EMPTY;
-                                } else if (cx >= x-2 && cx <= x+2 && cy >= y-2 && cy <= y+2) {
-                                    map.cells[ncurrent].type = FIRE;
-                                } else if (map.cells[ncurrent].type != EMPTY) {
-                                    int nx = cx + sign(cx-x) * (rand() % (abs(x-cx)+4));
-                                    int ny = cy + sign(cy-y) * (rand() % (abs(y-cy)+4));
-                                    if (nx >= 0 && nx <= (map.width-1) && ny >= 0 && ny <= (map.height-1)) {
-                                        int idx = (ny) * map.width + (nx);
-                                        map.cells[idx].type = map.cells[ncurrent].type;
-                                        map.cells[idx].timer = 0;
-                                        map.cells[ncurrent].type = FIRE;
-                                    }
-                                }
-                                map.cells[ncurrent].timer = 0;
-                                if (cy >= y)
-                                    map.cells[ncurrent].skip_update = true;
-                            }
-                        }
-                    }
-                    map.cells[current].type = EMPTY;
-                    map.cells[current].timer = 0;
-                } else {
-                    map.cells[current].timer++;
-                }
-                break;
+    for (int cell = 0; cell < w*h;) {
+        unsigned char type = map.types[(y0 + cell/w)*map.width + x0 + cell%w];
+        int run = 1;
+        while (cell+run < w*h && run < 256 && map.types[(y0 + (cell+run)/w)*map.width + x0 + (cell+run)%w] == type)
+            run++;
+        buf[len++] = run - 1;
+        buf[len++] = type;
+        cell += run;
+        if (type != EMPTY)
+            empty = false;
+    }
+
+    size_t count_at = len;
+    uint16_t timers = 0;
+    len += 2;
+    for (int cell = 0; cell < w*h; cell++) {
+        int idx = (y0 + cell/w)*map.width + x0 + cell%w;
+        if (map.types[idx] != BOMB || map.timers[idx] == 0)
+            continue;
+        uint16_t cell16 = cell;
+        int16_t timer = fuse_elapsed(map, idx);
+        memcpy(&buf[len], &cell16, 2);
+        memcpy(&buf[len+2], &timer, 2);
+        len += 4;
+        timers++;
+    }
+    memcpy(&buf[count_at], &timers, 2);
+
+    *lit = (timers > 0);
+    return (empty ? 0 : len);
+}
+
+// Сохраняет поле в файл PATH. Файл сначала пишется рядом и только потом подменяет старый,
+// чтобы ошибка посреди записи не испортила прошлое сохранение
+bool map_save(CellsMap map, const char *path) {
+    map_decode_rect(map, 0, 0, map.width-1, map.height-1); // Нераспакованные чанки тоже должны попасть в файл
+
+    int nchunks = map.chunks_w*map.chunks_h;
+    SaveChunk *dir = calloc(nchunks, sizeof(SaveChunk));
+    unsigned char *buf = malloc(CHUNK_SIZE*CHUNK_SIZE * 6 + 2); // Худший случай: серии по одной клетке и бомбы везде
+    char tmp_path[strlen(path) + 5];
+    sprintf(tmp_path, "%s.tmp", path);
+    FILE *file = fopen(tmp_path, "wb");
+
+    SaveHeader header = {
+        .magic = SAVE_MAGIC, .version = SAVE_VERSION,
+        .width = map.width, .height = map.height, .chunk_size = CHUNK_SIZE,
+        .seed = sim_seed, .passes = update_passes,
+    };
+    uint64_t offset = sizeof(header) + nchunks * sizeof(SaveChunk);
+    bool ok = (dir != NULL && buf != NULL && file != NULL && fseek(file, offset, SEEK_SET) == 0);
+
+    for (int i = 0; i < nchunks && ok; i++) {
+        Chunk *chunk = &map.chunks[i];
+        bool lit;
+        size_t size = chunk_encode(map, i, buf, &lit);
+        // Горящая бомба спит в колесе таймеров, которое не сохраняется: после загрузки её надо обновить,
+        // чтобы она встала в колесо заново
+        if (chunk->awake || chunk->nx0 <= chunk->nx1 || lit)
+            dir[i].flags |= SAVE_CHUNK_AWAKE;
+
+        if (size > 0) {
+            dir[i].offset = offset;
+            dir[i].size = size;
+            ok = (fwrite(buf, 1, size, file) == size);
+            offset += size;
+        }
+    }
+
+    if (ok) {
+        ok = (fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1 && \
+              fwrite(dir, sizeof(SaveChunk), nchunks, file) == (size_t)nchunks);
+    }
+    if (file != NULL && fclose(file) != 0)
+        ok = false;
+
+    if (ok) {
+        #ifdef _WIN32
+            remove(path); // rename в Windows не заменяет существующий файл
+        #endif
+        ok = (rename(tmp_path, path) == 0);
+    }
+    if (!ok && file != NULL)
+        remove(tmp_path);
+
+    free(dir);
+    free(buf);
+    return ok;
+}
+
+// Открывает файл сохранения и проверяет его заголовок и оглавление. Сами чанки пока не читаются:
+// файл отображается в память, и чанк распаковывается, только когда он кому-то понадобится
+ChunkLoader *loader_open(const char *path) {
+    ChunkLoader *loader = calloc(1, sizeof(ChunkLoader));
+    if (loader == NULL)
+        return NULL;
+
+    #ifdef _WIN32
+        FILE *file = fopen(path, "rb");
+        if (file != NULL && fseek(file, 0, SEEK_END) == 0) {
+            long size = ftell(file);
+            unsigned char *data = (size > 0 ? malloc(size) : NULL);
+            if (data != NULL && fseek(file, 0, SEEK_SET) == 0 && fread(data, 1, size, file) == (size_t)size) {
+                loader->data = data;
+                loader->size = size;
+            } else {
+                free(data);
+            }
+        }
+        if (file != NULL)
+            fclose(file);
+    #else
+        int fd = open(path, O_RDONLY);
+        struct stat st;
+        if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                loader->data = data;
+                loader->size = st.st_size;
+            }
+        }
+        if (fd != -1)
+            close(fd);
+    #endif
+
+    if (loader->data == NULL || loader->size < sizeof(SaveHeader)) {
+        loader_close(loader);
+        return NULL;
+    }
+
+    memcpy(&loader->header, loader->data, sizeof(SaveHeader));
+    SaveHeader *header = &loader->header;
+    if (memcmp(header->magic, SAVE_MAGIC, 4) != 0 || header->version != SAVE_VERSION || header->chunk_size != CHUNK_SIZE || \
+        header->width == 0 || header->height == 0 || header->width > USHRT_MAX || header->height > USHRT_MAX)
+    {
+        loader_close(loader);
+        return NULL;
+    }
+
+    size_t nchunks = (size_t)((header->width + CHUNK_SIZE-1) / CHUNK_SIZE) * ((header->height + CHUNK_SIZE-1) / CHUNK_SIZE);
+    loader->dir = (const SaveChunk *)(loader->data + sizeof(SaveHeader));
+    loader->state = malloc(nchunks * sizeof(int));
+    if (loader->state == NULL || loader->size < sizeof(SaveHeader) + nchunks * sizeof(SaveChunk)) {
+        loader_close(loader);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < nchunks; i++) {
+        if (loader->dir[i].size > 0 && loader->dir[i].offset <= loader->size && \
+            loader->dir[i].size <= loader->size - loader->dir[i].offset)
+        {
+            loader->state[i] = CHUNK_PENDING;
+            loader->pending++;
+        } else {
+            loader->state[i] = CHUNK_READY; // Пустой (или повреждённый) чанк распаковывать не нужно
+        }
+    }
+
+    return loader;
+}
+
+// Закрывает сохранение, когда из него распакованы все чанки
+void map_release_loader(CellsMap *map) {
+    if (map->loader != NULL && __atomic_load_n(&map->loader->pending, __ATOMIC_RELAXED) == 0) {
+        loader_close(map->loader);
+        map->loader = NULL;
+    }
+}
+
+// Заменяет всё поле содержимым сохранения. Размер поля должен совпадать с размером в сохранении.
+// Карта забирает LOADER себе и распаковывает чанки по мере надобности
+bool map_load(CellsMap *map, ChunkLoader *loader) {
+    if (loader->header.width != map->width || loader->header.height != map->height)
+        return false;
+
+    size_t size = map->width*map->height;
+    loader_close(map->loader);
+    map->loader = NULL;
+    plane_zero(map->types, size);
+    plane_zero(map->updated, size);
+    plane_zero(map->timers, size * sizeof(short));
+    plane_zero(map->velocity, size);
+    for (int i = 0; i < map->water->len; i++)
+        map->water->listed[map->water->cells[i]] = false;
+    map->water->len = 0;
+    map->water->stale = true;
+    burning_clear(*map);
+    map_sleep_all(*map);
+
+    sim_seed = loader->header.seed;
+    update_passes = loader->header.passes;
+    rng_seed(&thread_rng, sim_seed ^ (update_passes * 0x100000001B3ULL));
+
+    map->loader = loader;
+    // Население считается по сериям сохранения, не дожидаясь распаковки
+    long long filled = 0;
+    for (int i = 0; i < NUM_CELL_TYPES; i++)
+        map->population[i] = 0;
+    for (int i = 0; i < map->chunks_w*map->chunks_h; i++) {
+        if (loader->state[i] == CHUNK_PENDING)
+            chunk_count(*map, i, map->population);
+    }
+    for (int i = 0; i < NUM_CELL_TYPES; i++)
+        filled += map->population[i];
+    map->population[EMPTY] = (long long)size - filled;
+
+    // Огонь обновляется только из множества горящих клеток, поэтому чанки с огнём распаковываются сразу
+    for (int i = 0; i < map->chunks_w*map->chunks_h; i++) {
+        if (loader->state[i] != CHUNK_PENDING)
+            continue;
+        long long counts[NUM_CELL_TYPES] = {0};
+        chunk_count(*map, i, counts);
+        for (int type = 0; type < NUM_CELL_TYPES; type++) {
+            if (counts[type] > 0 && (cell_props[type].flags & CELL_BURNING)) {
+                int x0 = (i % map->chunks_w) * CHUNK_SIZE;
+                int y0 = (i / map->chunks_w) * CHUNK_SIZE;
+                int x1 = (x0 + CHUNK_SIZE < map->width ? x0 + CHUNK_SIZE : map->width) - 1;
+                int y1 = (y0 + CHUNK_SIZE < map->height ? y0 + CHUNK_SIZE : map->height) - 1;
+                map_decode_chunk(*map, i);
+                burning_scan(*map, x0, y0, x1, y1);
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < map->chunks_w*map->chunks_h; i++) {
+        if (loader->dir[i].flags & SAVE_CHUNK_AWAKE) {
+            int x0 = (i % map->chunks_w) * CHUNK_SIZE;
+            int y0 = (i / map->chunks_w) * CHUNK_SIZE;
+            map_touch_rect(*map, x0, y0, x0 + CHUNK_SIZE-1, y0 + CHUNK_SIZE-1);
+        }
+    }
+    map_release_loader(map);
+
+    return true;
+}
+
+pthread_mutex_t curs_mtx;
+
+static inline long long elapsed_ns(struct timespec start, struct timespec end) {
+    return (end.tv_sec - start.tv_sec) * NS + (end.tv_nsec - start.tv_nsec);
+}
+
+// Расписание с постоянным шагом: тики начинаются в моменты start + n*period, а не через period после конца
+// прошлого тика, поэтому время работы и неточность сна не накапливаются
+typedef struct {
+    long long period_ns; // Шаг расписания (0 – не ждать вовсе)
+    int max_catchup; // Сколько шагов можно отставать, догоняя расписание без сна
+    struct timespec next; // Когда должен начаться следующий шаг
+    unsigned long long dropped; // Сколько шагов пропущено, потому что отставание стало больше max_catchup
+} Pacer;
+
+// Длительности последних TICK_SAMPLES шагов и счётчики, по которым считаются частота и перцентили
+typedef struct {
+    long long samples[TICK_SAMPLES]; // В наносекундах, по кругу
+    unsigned long long count; // Сколько шагов сделано всего
+    struct timespec first, last; // Когда начались первый и последний шаги
+} TickStats;
+
+void pacer_start(Pacer *pacer, int rate, int max_catchup) {
+    pacer->period_ns = (rate > 0 ? NS / rate : 0);
+    pacer->max_catchup = max_catchup;
+    pacer->dropped = 0;
+    clock_gettime(CLOCK_MONOTONIC, &pacer->next);
+}
+
+// Ждёт начала следующего шага. Если шаг опоздал, сразу возвращается, чтобы догнать расписание,
+// а если отставание больше max_catchup шагов, пропускает их и начинает расписание заново с текущего момента
+void pacer_wait(Pacer *pacer) {
+    if (pacer->period_ns == 0)
+        return;
+
+    pacer->next.tv_nsec += pacer->period_ns;
+    pacer->next.tv_sec += pacer->next.tv_nsec / NS;
+    pacer->next.tv_nsec %= NS;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long late_ns = elapsed_ns(pacer->next, now);
+    if (late_ns > pacer->max_catchup * pacer->period_ns) {
+        pacer->dropped += late_ns / pacer->period_ns;
+        pacer->next = now;
+    } else if (late_ns < 0) {
+        #ifdef _WIN32
+            struct timespec delay = {-late_ns / NS, -late_ns % NS};
+            nanosleep(&delay, NULL);
+        #else
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &pacer->next, NULL) == EINTR);
+        #endif
+    }
+}
+
+void tick_stats_add(TickStats *stats, struct timespec start, struct timespec end) {
+    if (stats->count == 0)
+        stats->first = start;
+    stats->last = start;
+    stats->samples[stats->count++ % TICK_SAMPLES] = elapsed_ns(start, end);
+}
+
+int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Перцентиль PERCENT длительности шага среди последних TICK_SAMPLES шагов, в наносекундах
+long long tick_stats_percentile(const TickStats *stats, int percent) {
+    size_t n = (stats->count < TICK_SAMPLES ? stats->count : TICK_SAMPLES);
+    if (n == 0)
+        return 0;
+    long long sorted[TICK_SAMPLES];
+    memcpy(sorted, stats->samples, n * sizeof(long long));
+    qsort(sorted, n, sizeof(long long), compare_ll);
+    return sorted[(n-1) * percent / 100];
+}
+
+// Сколько шагов в секунду получилось на самом деле
+double tick_stats_rate(const TickStats *stats) {
+    long long ns = elapsed_ns(stats->first, stats->last);
+    return (ns > 0 ? (stats->count-1) * (double)NS / ns : 0);
+}
+
+// Счётчики работы симуляции. Каждый поток обновления копит свои и сбрасывает их в profile.counters
+typedef struct {
+    unsigned long long visited; // Сколько клеток обработано
+    unsigned long long moved; // Сколько клеток сдвинулось
+    unsigned long long fire_spread; // Сколько раз огонь перекинулся на дерево
+    unsigned long long detonations; // Сколько бомб взорвалось
+} SimCounters;
+
+// Средние значения за последний интервал PROFILE_INTERVAL_MS
+typedef struct {
+    double seconds; // Время от запуска
+    unsigned long long ticks; // Тиков за интервал
+    double tps;
+    double tick_p50_ms, tick_p99_ms; // Перцентили времени тика среди последних TICK_SAMPLES тиков
+    double update_ms, water_ms; // Основной проход и проходы воды, на тик
+    double render_ms; // Отрисовка, на кадр
+    double lock_wait_ms; // Ожидание curs_mtx всеми потоками, на тик
+    double visited, moved, fire_spread, detonations; // На тик
+    unsigned long long population[NUM_CELL_TYPES]; // Сколько клеток каждого типа на всём поле
+} ProfileSample;
+
+const char *cell_type_names[NUM_CELL_TYPES] = {"empty", "sand", "water", "stone", "wood", "ash", "fire", "bomb", "steam"};
+
+_Thread_local SimCounters thread_counters; // Счётчики потока, который обновляет карту
+
+// Накопленные за текущий интервал замеры. Счётчики и время отрисовки и ожидания блокировки
+// пополняются атомарно, остальное пишет только поток симуляции
+struct {
+    SimCounters counters;
+    unsigned long long ticks;
+    long long update_ns, water_ns;
+    long long render_ns;
+    unsigned long long frames;
+    long long lock_wait_ns;
+    struct timespec start, last; // Запуск и последний замер
+    ProfileSample sample; // Последний готовый замер, читается под curs_mtx
+    unsigned samples; // Сколько замеров сделано
+    FILE *file; // --stats-file
+} profile;
+
+bool show_profile = false; // Показывать панель профилирования (F3)
+
+// Захватывает curs_mtx. Время ожидания учитывается, только если мьютекс занят, так что обычный захват
+// стоит как раньше
+void curs_lock(void) {
+    if (pthread_mutex_trylock(&curs_mtx) == 0)
+        return;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&curs_mtx);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    __atomic_add_fetch(&profile.lock_wait_ns, elapsed_ns(start, end), __ATOMIC_RELAXED);
+}
+
+// Переносит счётчики потока в общие
+void counters_flush(void) {
+    __atomic_add_fetch(&profile.counters.visited, thread_counters.visited, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&profile.counters.moved, thread_counters.moved, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&profile.counters.fire_spread, thread_counters.fire_spread, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&profile.counters.detonations, thread_counters.detonations, __ATOMIC_RELAXED);
+    thread_counters = (SimCounters){0};
+}
+
+void profile_start(FILE *file) {
+    profile.file = file;
+    clock_gettime(CLOCK_MONOTONIC, &profile.start);
+    profile.last = profile.start;
+    if (file != NULL) {
+        fprintf(file, "seconds,ticks,tps,tick_p50_ms,tick_p99_ms,update_ms,water_ms,render_ms,lock_wait_ms,"
+                      "visited,moved,fire_spread,detonations");
+        for (int i = 0; i < NUM_CELL_TYPES; i++)
+            fprintf(file, ",%s", cell_type_names[i]);
+        fprintf(file, "\n");
+    }
+}
+
+// Собирает из накопленного замер, пишет его в --stats-file и отдаёт панели
+void profile_sample(CellsMap map, const TickStats *stats) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long interval_ns = elapsed_ns(profile.last, now);
+    if (profile.ticks == 0 || interval_ns <= 0)
+        return;
+
+    ProfileSample sample = {0};
+    double ticks = profile.ticks;
+    unsigned long long frames = __atomic_exchange_n(&profile.frames, 0, __ATOMIC_RELAXED);
+    sample.seconds = elapsed_ns(profile.start, now) / 1e9;
+    sample.ticks = profile.ticks;
+    sample.tps = profile.ticks * (double)NS / interval_ns;
+    sample.tick_p50_ms = tick_stats_percentile(stats, 50) / 1e6;
+    sample.tick_p99_ms = tick_stats_percentile(stats, 99) / 1e6;
+    sample.update_ms = profile.update_ns / 1e6 / ticks;
+    sample.water_ms = profile.water_ns / 1e6 / ticks;
+    sample.render_ms = __atomic_exchange_n(&profile.render_ns, 0, __ATOMIC_RELAXED) / 1e6 / (frames > 0 ? frames : 1);
+    sample.lock_wait_ms = __atomic_exchange_n(&profile.lock_wait_ns, 0, __ATOMIC_RELAXED) / 1e6 / ticks;
+    sample.visited = __atomic_exchange_n(&profile.counters.visited, 0, __ATOMIC_RELAXED) / ticks;
+    sample.moved = __atomic_exchange_n(&profile.counters.moved, 0, __ATOMIC_RELAXED) / ticks;
+    sample.fire_spread = __atomic_exchange_n(&profile.counters.fire_spread, 0, __ATOMIC_RELAXED) / ticks;
+    sample.detonations = __atomic_exchange_n(&profile.counters.detonations, 0, __ATOMIC_RELAXED) / ticks;
+
+    profile.ticks = 0;
+    profile.update_ns = profile.water_ns = 0;
+    profile.last = now;
+
+    for (int i = 0; i < NUM_CELL_TYPES; i++) // Население ведётся по ходу симуляции, считать его заново не нужно
+        sample.population[i] = map.population[i];
+
+    if (profile.file != NULL) {
+        fprintf(profile.file, "%.3f,%llu,%.2f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.1f,%.1f,%.2f,%.2f",
+                sample.seconds, sample.ticks, sample.tps, sample.tick_p50_ms, sample.tick_p99_ms, sample.update_ms,
+                sample.water_ms, sample.render_ms, sample.lock_wait_ms, sample.visited, sample.moved,
+                sample.fire_spread, sample.detonations);
+        for (int i = 0; i < NUM_CELL_TYPES; i++)
+            fprintf(profile.file, ",%llu", sample.population[i]);
+        fprintf(profile.file, "\n");
+        fflush(profile.file);
+    }
+
+    curs_lock();
+    profile.sample = sample;
+    profile.samples++;
+    pthread_mutex_unlock(&curs_mtx);
+}
+
+// Учитывает законченный тик и раз в PROFILE_INTERVAL_MS делает замер
+void profile_tick(CellsMap map, long long update_ns, long long water_ns, const TickStats *stats) {
+    counters_flush();
+    profile.ticks++;
+    profile.update_ns += update_ns;
+    profile.water_ns += water_ns;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (elapsed_ns(profile.last, now) >= PROFILE_INTERVAL_MS * 1000000LL)
+        profile_sample(map, stats);
+}
+
+void snapshots_destroy(Snapshots *snaps) {
+    for (int i = 0; i < 3; i++)
+        free(snaps->slots[i].types);
+    *snaps = (Snapshots){.back = 0, .front = 2, .ready = 1};
+}
+
+// Копирует видимую часть поля в буфер симуляции и публикует его вместо предыдущего снимка.
+// Возвращает false, если не хватило памяти; тогда остаётся виден предыдущий снимок
+bool snapshot_publish(Snapshots *snaps, CellsMap map) {
+    Snapshot *snap = &snaps->slots[snaps->back];
+
+    curs_lock();
+    snap->x = view.x;
+    snap->y = view.y;
+    snap->width = (view.width < map.width - view.x ? view.width : map.width - view.x);
+    snap->height = (view.height < map.height - view.y ? view.height : map.height - view.y);
+    pthread_mutex_unlock(&curs_mtx);
+    if (snap->width < 0) snap->width = 0;
+    if (snap->height < 0) snap->height = 0;
+
+    size_t size = (size_t)snap->width*snap->height;
+    if (size > snap->cap) { // Экран стал больше
+        unsigned char *types = realloc(snap->types, size);
+        if (types == NULL)
+            return false;
+        snap->types = types;
+        snap->cap = size;
+    }
+
+    map_decode_rect(map, snap->x, snap->y, snap->x + snap->width-1, snap->y + snap->height-1);
+    for (int y = 0; y < snap->height; y++)
+        memcpy(&snap->types[y*snap->width], &map.types[(snap->y + y)*map.width + snap->x], snap->width);
+    snaps->back = __atomic_exchange_n(&snaps->ready, snaps->back | SNAPSHOT_FRESH, __ATOMIC_ACQ_REL) & ~SNAPSHOT_FRESH;
+    return true;
+}
+
+// Забирает последний опубликованный снимок для отрисовки. Возвращает false, если нового снимка ещё нет
+bool snapshot_acquire(Snapshots *snaps) {
+    if (!(__atomic_load_n(&snaps->ready, __ATOMIC_ACQUIRE) & SNAPSHOT_FRESH))
+        return false;
+    snaps->front = __atomic_exchange_n(&snaps->ready, snaps->front, __ATOMIC_ACQ_REL) & ~SNAPSHOT_FRESH;
+    return true;
+}
+
+// Не даёт видимой части выйти за границы поля. Вызывается под curs_mtx
+void view_clamp(CellsMap map) {
+    if (view.x > map.width - view.width) view.x = map.width - view.width;
+    if (view.y > map.height - view.height) view.y = map.height - view.height;
+    if (view.x < 0) view.x = 0;
+    if (view.y < 0) view.y = 0;
+}
+
+// Сдвигает видимую часть поля так, чтобы на ней был курсор. Вызывается под curs_mtx
+void view_follow(Cursor *curs, CellsMap map) {
+    if (curs->x < view.x) view.x = curs->x;
+    if (curs->x >= view.x + view.width) view.x = curs->x - view.width + 1;
+    if (curs->y < view.y) view.y = curs->y;
+    if (curs->y >= view.y + view.height) view.y = curs->y - view.height + 1;
+    view_clamp(map);
+}
+
+// Сдвигает видимую часть поля на четверть экрана в направлении (DX, DY) и тянет за собой курсор,
+// если он остался за краем. Вызывается под curs_mtx
+void view_pan(Cursor *curs, CellsMap map, int dx, int dy) {
+    view.x += dx * (view.width/4 > 1 ? view.width/4 : 1);
+    view.y += dy * (view.height/4 > 1 ? view.height/4 : 1);
+    view_clamp(map);
+
+    if (curs->x < view.x) curs->x = view.x;
+    if (curs->x > view.x + view.width-1) curs->x = view.x + view.width-1;
+    if (curs->y < view.y) curs->y = view.y;
+    if (curs->y > view.y + view.height-1) curs->y = view.y + view.height-1;
+    if (curs->x > map.width-1) curs->x = map.width-1;
+    if (curs->y > map.height-1) curs->y = map.height-1;
+}
+
+// Сообщение в строке состояния и время, когда оно появилось. Меняются под curs_mtx
+struct {
+    const char *text;
+    struct timespec time;
+} notice;
+
+const char *save_path = DEFAULT_SAVE_FILE; // Куда сохранять поле и откуда его загружать во время игры
+
+// Показывает в строке состояния сообщение на NOTICE_MS миллисекунд
+void show_notice(const char *text) {
+    curs_lock();
+    notice.text = text;
+    clock_gettime(CLOCK_MONOTONIC, &notice.time);
+    pthread_mutex_unlock(&curs_mtx);
+}
+
+// Возвращает текущее сообщение или NULL, если его время прошло
+const char *notice_text(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    curs_lock();
+    const char *text = notice.text;
+    if (text != NULL && elapsed_ns(notice.time, now) >= NOTICE_MS * 1000000LL)
+        text = notice.text = NULL;
+    pthread_mutex_unlock(&curs_mtx);
+    return text;
+}
+
+EditRing edits; // Правки поля, которые поток ввода передаёт симуляции
+
+// Кладёт правку в очередь. Если очередь заполнена, ждёт, пока симуляция её разберёт, чтобы правка не потерялась
+void edit_ring_push(EditRing *ring, EditCommand command) {
+    unsigned head = ring->head;
+    while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == EDIT_RING_SIZE) {
+        struct timespec delay = {0, NS / 1000};
+        nanosleep(&delay, NULL);
+    }
+    ring->commands[head % EDIT_RING_SIZE] = command;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Применяет к полю одну правку
+void map_apply_edit(CellsMap *map, EditCommand command) {
+    switch (command.kind) {
+    case EDIT_PAINT: {
+        int x0 = (command.x0 > 0 ? command.x0 : 0), x1 = (command.x1 < map->width-1 ? command.x1 : map->width-1);
+        int y0 = (command.y0 > 0 ? command.y0 : 0), y1 = (command.y1 < map->height-1 ? command.y1 : map->height-1);
+        map_decode_rect(*map, x0, y0, x1, y1); // Иначе распаковка чанка потом затрёт нарисованное
+        for (int y = y0; y <= y1; y++) {
+            for (int x = x0; x <= x1; x++) {
+                set_type(*map, y*map->width + x, command.type);
+                map->timers[y*map->width + x] = 0;
+                map->velocity[y*map->width + x] = 0;
+            }
+        }
+        if (cell_props[command.type].flags & CELL_BURNING)
+            burning_scan(*map, x0, y0, x1, y1);
+        map_touch_rect(*map, command.x0-1, command.y0-1, command.x1+1, command.y1+1);
+        population_flush(*map);
+        break;
+    }
+    case EDIT_CLEAR:
+        loader_close(map->loader); // Нераспакованные чанки сохранения больше не нужны
+        map->loader = NULL;
+        plane_zero(map->types, map->width*map->height); // EMPTY – это ноль
+        plane_zero(map->velocity, map->width*map->height);
+        for (int i = 0; i < NUM_CELL_TYPES; i++)
+            map->population[i] = 0;
+        map->population[EMPTY] = (long long)map->width*map->height;
+        burning_clear(*map);
+        map_sleep_all(*map);
+        break;
+    case EDIT_SAVE:
+        show_notice(map_save(*map, save_path) ? "Saved" : "Save failed");
+        break;
+    case EDIT_LOAD: {
+        ChunkLoader *loader = loader_open(save_path);
+        if (loader != NULL && map_load(map, loader)) {
+            show_notice("Loaded");
+        } else {
+            loader_close(loader);
+            show_notice("Load failed");
+        }
+        break;
+    }
+    default: // Остальные команды поле не меняют
+        return;
+    }
+    map->water->stale = true;
+}
+
+// Забирает из очереди следующую правку. Возвращает false, если очередь пуста
+bool edit_ring_pop(EditRing *ring, EditCommand *command) {
+    unsigned tail = ring->tail;
+    if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+        return false;
+    *command = ring->commands[tail % EDIT_RING_SIZE];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Выводит контрольную сумму типов всех клеток (FNV-1a), чтобы сравнить запись и её повтор
+uint64_t map_checksum(CellsMap map) {
+    map_decode_rect(map, 0, 0, map.width-1, map.height-1);
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < (size_t)map.width*map.height; i++)
+        hash = (hash ^ map.types[i]) * 0x100000001B3ULL;
+    return hash;
+}
+
+
+// Кладёт символ в кадр, который собирается для вывода
+#define frame_put(row, col, glyph_, attr_) (frame.next[(row)*frame.width + (col)] = (FrameCell){glyph_, attr_})
+// Символ кадра в виде, понятном ncurses
+#define frame_chtype(cell) ((unsigned char)(cell).glyph | COLOR_PAIR((cell).attr & ~FRAME_PROTECT) | \
+                            (((cell).attr & FRAME_PROTECT) ? A_PROTECT : 0))
+
+Backend backend = BACKEND_NCURSES;
+
+// Заставляет следующий кадр вывести весь экран заново, например, после того как поверх поля рисовало меню
+void render_invalidate(void) {
+    memset(frame.shown, 0, frame.width*frame.height * sizeof(FrameCell));
+    ansi.row = ansi.col = ansi.fg = ansi.bg = -1; // ncurses мог сдвинуть курсор и поменять цвет
+}
+
+// Готовит цвета палитры для бэкенда ANSI
+void ansi_init(bool no_colors) {
+    ansi.colors = !no_colors;
+
+    for (size_t i = 0; i < PALETTE_SIZE; i++) {
+        sprintf(ansi.fg_sgr[i], "38;2;%d;%d;%d", palette[i].r, palette[i].g, palette[i].b);
+        sprintf(ansi.bg_sgr[i], "48;2;%d;%d;%d", palette[i].r, palette[i].g, palette[i].b);
+    }
+    for (size_t i = 0; i < sizeof(color_pairs)/sizeof(color_pairs[0]); i++) {
+        for (size_t j = 0; j < PALETTE_SIZE; j++) {
+            if (palette[j].color == color_pairs[i].fg) ansi.pair_fg[color_pairs[i].pair] = j;
+            if (palette[j].color == color_pairs[i].bg) ansi.pair_bg[color_pairs[i].pair] = j;
+        }
+    }
+}
+
+// Включает цвета пары ATTR, дописывая в буфер только те из них, что отличаются от уже включённых.
+// У пробела цвет символа не виден, поэтому для него достаточно совпадения фона
+void ansi_set_colors(int attr, char glyph) {
+    if (!ansi.colors) {
+        if (ansi.bg == -1) { // Состояние неизвестно, сбрасываем атрибуты один раз
+            memcpy(ansi.buf + ansi.len, "\033[0m", 4);
+            ansi.len += 4;
+            ansi.fg = ansi.bg = 0;
+        }
+        return;
+    }
+
+    int fg = ansi.pair_fg[attr], bg = ansi.pair_bg[attr];
+    bool set_fg = (fg != ansi.fg && glyph != ' ');
+    bool set_bg = (bg != ansi.bg);
+    if (!set_fg && !set_bg)
+        return;
+
+    ansi.len += sprintf(ansi.buf + ansi.len, "\033[%s%s%sm", (set_fg ? ansi.fg_sgr[fg] : ""),
+                        (set_fg && set_bg ? ";" : ""), (set_bg ? ansi.bg_sgr[bg] : ""));
+    if (set_fg) ansi.fg = fg;
+    if (set_bg) ansi.bg = bg;
+}
+
+// Выводит байты в терминал, не пропуская их через буферы stdio и ncurses
+void ansi_write(const char *data, size_t len) {
+    ansi.writes++;
+    ansi.bytes += len;
+    #ifdef _WIN32
+        DWORD written;
+        WriteFile(GetStdHandle(STD_OUTPUT_HANDLE), data, len, &written, NULL);
+    #else
+        while (len > 0) {
+            ssize_t written = write(STDOUT_FILENO, data, len);
+            if (written <= 0)
+                break;
+            data += written;
+            len -= written;
+        }
+    #endif
+}
+
+// Добавляет в буфер кадра отрезок строки ROW, начиная со столбца START.
+// Курсор переводится только если он стоит не там, цвет меняется только там, где он становится виден другим
+void ansi_put_run(int row, int start, FrameCell *cells, int len) {
+    int term_row = row + 2, term_col = start + 2; // Координаты терминала считаются с 1, плюс рамка окна
+    if (ansi.row != term_row) {
+        ansi.len += sprintf(ansi.buf + ansi.len, "\033[%d;%dH", term_row, term_col);
+    } else if (ansi.col < term_col) {
+        ansi.len += sprintf(ansi.buf + ansi.len, "\033[%dC", term_col - ansi.col);
+    } else if (ansi.col > term_col) {
+        ansi.len += sprintf(ansi.buf + ansi.len, "\033[%dG", term_col);
+    }
+
+    for (int i = 0; i < len; i++) {
+        ansi_set_colors(cells[i].attr & ~FRAME_PROTECT, cells[i].glyph);
+        ansi.buf[ansi.len++] = cells[i].glyph;
+    }
+
+    ansi.row = term_row;
+    ansi.col = term_col + len;
+}
+
+// Выводит в окно те символы кадра, которые отличаются от уже выведенных.
+// Соседние изменения в строке склеиваются в одну запись, если между ними не больше FRAME_GAP одинаковых символов
+void frame_flush(WINDOW *window) {
+    chtype run[frame.width];
+    ansi.len = 0;
+
+    for (int row = 0; row < frame.height; row++) {
+        FrameCell *next = &frame.next[row*frame.width];
+        FrameCell *shown = &frame.shown[row*frame.width];
+        if (memcmp(next, shown, frame.width * sizeof(FrameCell)) == 0)
+            continue;
+
+        int col = 0;
+        while (col < frame.width) {
+            if (next[col].glyph == shown[col].glyph && next[col].attr == shown[col].attr) {
+                col++;
+                continue;
+            }
+
+            int start = col;
+            int end = col + 1; // Конец отрезка (не включительно)
+            for (int gap = 0; col < frame.width && gap <= FRAME_GAP; col++) {
+                if (next[col].glyph != shown[col].glyph || next[col].attr != shown[col].attr) {
+                    end = col + 1;
+                    gap = 0;
+                } else {
+                    gap++;
+                }
+            }
+
+            if (backend == BACKEND_ANSI) {
+                ansi_put_run(row, start, &next[start], end - start);
+            } else {
+                for (int i = start; i < end; i++)
+                    run[i - start] = frame_chtype(next[i]);
+                wmove(window, row + 1, start + 1);
+                waddchnstr(window, run, end - start);
+            }
+            col = end;
+        }
+
+        memcpy(shown, next, frame.width * sizeof(FrameCell));
+    }
+}
+
+// Переносит в окно ncurses кадр, который бэкенд ANSI вывел в обход него, чтобы ncurses мог рисовать поверх.
+// Следующее обновление экрана ncurses перерисует его целиком, так как ncurses не знает, где сейчас курсор
+void frame_sync_window(WINDOW *window) {
+    chtype line[frame.width];
+
+    for (int row = 0; row < frame.height; row++) {
+        for (int col = 0; col < frame.width; col++)
+            line[col] = frame_chtype(frame.shown[row*frame.width + col]);
+        wmove(window, row + 1, 1);
+        waddchnstr(window, line, frame.width);
+    }
+    clearok(curscr, TRUE);
+    wnoutrefresh(window);
+}
+
+// Пишет строку в кадр, дополняя её пробелами до WIDTH символов и обрезая по краю экрана
+void frame_puts(int row, int col, const char *text, int width) {
+    if (row >= frame.height)
+        return;
+    for (int i = 0; i < width && col+i < frame.width; i++) {
+        frame_put(row, col+i, (*text ? *text : ' '), EMPTY);
+        if (*text) text++;
+    }
+}
+
+// Рисует панель профилирования под строкой состояния
+void render_profile(const ProfileSample *sample) {
+    char line[PROFILE_WIDTH+1];
+    int row = 1;
+
+    snprintf(line, sizeof(line), " tps %.1f  tick p50 %.3f p99 %.3f ms", sample->tps, sample->tick_p50_ms, sample->tick_p99_ms);
+    frame_puts(row++, 0, line, PROFILE_WIDTH);
+    snprintf(line, sizeof(line), " update %.3f  water %.3f ms/tick", sample->update_ms, sample->water_ms);
+    frame_puts(row++, 0, line, PROFILE_WIDTH);
+    snprintf(line, sizeof(line), " render %.3f ms  curs wait %.3f ms", sample->render_ms, sample->lock_wait_ms);
+    frame_puts(row++, 0, line, PROFILE_WIDTH);
+    snprintf(line, sizeof(line), " visited %.0f  moved %.0f /tick", sample->visited, sample->moved);
+    frame_puts(row++, 0, line, PROFILE_WIDTH);
+    snprintf(line, sizeof(line), " fire spread %.2f  bombs %.2f /tick", sample->fire_spread, sample->detonations);
+    frame_puts(row++, 0, line, PROFILE_WIDTH);
+    for (int type = SAND; type < NUM_CELL_TYPES; type += 3) {
+        int len = 0;
+        for (int i = type; i < type+3 && i < NUM_CELL_TYPES && len < (int)sizeof(line); i++)
+            len += snprintf(line + len, sizeof(line) - len, " %s %llu", cell_type_names[i], sample->population[i]);
+        frame_puts(row++, 0, line, PROFILE_WIDTH);
+    }
+}
+
+void render(WINDOW *window, Snapshots *snaps, Cursor cursor, CellInfo cells_info[], bool square_pixels, bool simple_fire, bool simple_steam, bool paused, const char *notice, const ProfileSample *profile_sample) {
+    if (frame.width != MAPW || frame.height != MAPH) { // Размер терминала изменился
+        free(frame.shown);
+        free(frame.next);
+        free(frame.skip);
+        free(ansi.buf);
+        frame.width = MAPW;
+        frame.height = MAPH;
+        frame.shown = calloc(frame.width*frame.height, sizeof(FrameCell));
+        frame.next = calloc(frame.width*frame.height, sizeof(FrameCell));
+        frame.skip = calloc(frame.width*frame.height, 1);
+        // Худший случай: у каждого символа своя пара, и каждая строка начинается с перевода курсора
+        ansi.cap = (size_t)frame.width*frame.height * (SGR_MAX + 1) + frame.height * 16;
+        ansi.buf = (backend == BACKEND_ANSI ? malloc(ansi.cap) : NULL);
+        if (frame.shown == NULL || frame.next == NULL || frame.skip == NULL || (backend == BACKEND_ANSI && ansi.buf == NULL)) {
+            frame.width = frame.height = 0;
+            return;
+        }
+        render_invalidate();
+    }
+
+    Snapshot *snap = &snaps->slots[snaps->front];
+    const unsigned char *types = snap->types;
+
+    // Мьютекс курсора здесь не нужен: курсор и замеры уже скопированы под ним, а передний снимок
+    // принадлежит только потоку отрисовки. Иначе симуляция ждала бы в snapshot_publish весь обход экрана
+
+    int render_height, render_width;
+    render_height = (MAPH < snap->height ? MAPH : snap->height);
+    if (square_pixels) {
+        render_width = (MAPW/2 < snap->width ? MAPW/2 : snap->width);
+    } else {
+        render_width = (MAPW < snap->width ? MAPW : snap->width);
+    }
+
+    // Кадр собирается поверх того, что уже на экране: клетки, которые пропускаются, остаются как есть
+    memcpy(frame.next, frame.shown, frame.width*frame.height * sizeof(FrameCell));
+
+    for (int y = 0; y < render_height; y++) {
+        for (int x = 0; x < render_width; x++) {
+            int current = y*snap->width + x;
+
+            if (frame.skip[y*frame.width + x]) {
+                frame.skip[y*frame.width + x] = false;
+                continue;
+            }
+            CellInfo current_cell_info = cells_info[types[current]];
+            if (incursor(snap->x + x, snap->y + y, cursor)) {
+                if (types[current] == EMPTY) {
+                    for (int i = 0; i <= square_pixels; i++)
+                        frame_put(y, x*(1+square_pixels) + i, CURSOR_SPRITE, CURSOR_ID);
+                } else {
+                    for (int i = 0; i <= square_pixels; i++)
+                        frame_put(y, x*(1+square_pixels) + i, current_cell_info.sprites[0], CURSOR_ID);
+                }
+            } else {
+                for (int i = 0; i <= square_pixels; i++) {
+                    if (types[current] == FIRE)
+                        frame_put(y, x*(1+square_pixels) + i, cells_info[FIRE].sprites[rng_below(&render_rng, 2)], cells_info[FIRE].colors[rng_below(&render_rng, 2)]);
+                    else
+                        frame_put(y, x*(1+square_pixels) + i, current_cell_info.sprites[0], current_cell_info.colors[0] | FRAME_PROTECT);
+                }
+
+                if (types[current] == FIRE && !simple_fire) {
+                    int neighbors_x[8] = {x-1, x, x+1, x-1, x+1, x-1, x, x+1};
+                    int neighbors_y[8] = {y-1, y-1, y-1, y, y, y+1, y+1, y+1};
+                    
+                    for (int i = 0; i < 8; i++) {
+                        if (neighbors_x[i] >= 0 && neighbors_x[i] <= (render_width-1) && \
+                            neighbors_y[i] >= 0 && neighbors_y[i] <= (render_height-1) && \
+                            (rng_below(&render_rng, 10) < 3) && !incursor(snap->x + neighbors_x[i], snap->y + neighbors_y[i], cursor))
+                        {
+                            frame.skip[neighbors_y[i]*frame.width + neighbors_x[i]] = true;
+                            for (int k = 0; k <= square_pixels; k++)
+                                frame_put(neighbors_y[i], neighbors_x[i]*(1+square_pixels) + k, cells_info[FIRE].sprites[rng_below(&render_rng, 2)], cells_info[FIRE].colors[rng_below(&render_rng, 2)]);
+                        }
+                    }
+                } else if (types[current] == STEAM && !simple_steam) {
+                    int neighbors_x[4] = {x, x+1, x, x-1};
+                    int neighbors_y[4] = {y-1, y, y+1, y};
+                    for (int i = 0; i < 4; i++) {
+                        if (neighbors_x[i] >= 0 && neighbors_x[i] <= (render_width-1) && \
+                            neighbors_y[i] >= 0 && neighbors_y[i] <= (render_height-1) && \
+                            !incursor(snap->x + neighbors_x[i], snap->y + neighbors_y[i], cursor))
+                        {
+                            frame.skip[neighbors_y[i]*frame.width + neighbors_x[i]] = true;
+                            for (int k = 0; k <= square_pixels; k++)
+                                frame_put(neighbors_y[i], neighbors_x[i]*(1+square_pixels) + k, cells_info[STEAM].sprites[0], cells_info[STEAM].colors[1]);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    CellInfo brush_info = cells_info[cursor.brush];
+
+    frame_put(0, 0, brush_info.sprites[0], brush_info.colors[0]);
+
+    char brushsize_str[3];
+    sprintf(brushsize_str, "%d", (cursor.brush_size <= 99 ? cursor.brush_size : 99));
+    for (int i = 0; brushsize_str[i] && i+2 < frame.width; i++)
+        frame_put(0, i+2, brushsize_str[i], EMPTY);
+
+    for (int i = 0; brush_info.name[i] && i+5 < frame.width; i++)
+        frame_put(0, i+5, brush_info.name[i], EMPTY);
+
+    for (int i = 0; notice != NULL && notice[i] && i+12 < frame.width-8; i++)
+        frame_put(0, i+12, notice[i], EMPTY);
+
+    if (paused && frame.width >= 7) {
+        for (int i = 0; i < 6; i++)
+            frame_put(0, frame.width-7 + i, "Paused"[i], EMPTY);
+    }
+
+    if (profile_sample != NULL)
+        render_profile(profile_sample);
+
+    frame_flush(window);
+
+    if (backend == BACKEND_ANSI) {
+        if (ansi.len > 0) {
+            ansi_write(ansi.buf, ansi.len);
+            ansi.frames++;
+        } else {
+            ansi.unchanged++;
+        }
+    } else {
+        wnoutrefresh(window);
+        doupdate();
+    }
+}
+
+unsigned short displace_mask[NUM_CELL_TYPES]; // Бит T установлен, если клетка этого типа может занять место клетки типа T
+MoveRule move_rules[MOB_GAS][NEAR_MASKS]; // Куда сдвинуться сыпучей клетке или жидкости при данной маске соседей
+unsigned char react_rules[2][REACT_MASKS]; // Реакция бомбы (0) или огня (1) при объединении флагов соседей
+unsigned granular_types; // Сыпучие типы, которые падают в пустоту: их разбирает granular_row
+unsigned granular_other; // Непустые типы, на место которых могут упасть сыпучие клетки (вода, пар)
+unsigned inert_types; // Типы, которые сами ничего не делают: update_cell для них можно не звать
+
+// Правило для сыпучих клеток: вниз, иначе по диагонали вниз
+MoveRule powder_rule(int near) {
+    if (near & NEAR_B)
+        return (MoveRule){0, 1, false, false};
+    if ((near & NEAR_BL) && (near & NEAR_BR))
+        return (MoveRule){0, 1, true, false};
+    if (near & NEAR_BL)
+        return (MoveRule){-1, 1, false, false};
+    if (near & NEAR_BR)
+        return (MoveRule){1, 1, false, false};
+    return (MoveRule){0};
+}
+
+// Правило для жидкостей: вниз, иначе в сторону, если по диагонали вниз некуда, иначе по диагонали вниз
+MoveRule liquid_rule(int near) {
+    if (near & NEAR_B)
+        return (MoveRule){0, 1, false, true};
+    if (!(near & (NEAR_BL | NEAR_BR))) {
+        if ((near & NEAR_L) && (near & NEAR_R))
+            return (MoveRule){0, 0, true, false};
+        if (near & NEAR_L)
+            return (MoveRule){-1, 0, false, false};
+        if (near & NEAR_R)
+            return (MoveRule){1, 0, false, false};
+        return (MoveRule){0};
+    }
+    MoveRule rule = powder_rule(near);
+    rule.settle_gas = true;
+    return rule;
+}
+
+// Реакция огня: вода рядом тушит его, иначе он перекидывается на горючих соседей, а если их нет – гаснет.
+// Бомбы рядом огонь взрывает сам: они спят в колесе таймеров и огонь вокруг себя не ищут
+unsigned char fire_rule(int near_flags) {
+    unsigned char ignite = (near_flags & CELL_EXPLOSIVE) ? REACT_IGNITE_BOMBS : 0;
+    if (near_flags & CELL_QUENCHES)
+        return REACT_QUENCH | ignite;
+    if (near_flags & CELL_FLAMMABLE)
+        return REACT_SPREAD | ignite;
+    return REACT_BURN_OUT | ignite;
+}
+
+// Реакция бомбы: соседей она не смотрит (её взрывает огонь), а ждёт таймера
+unsigned char bomb_rule(int near_flags) {
+    (void)near_flags;
+    return REACT_FUSE;
+}
+
+// Заполняет таблицы, по которым update_cell выбирает ход, а react_cell – реакцию
+void rules_init(void) {
+    for (int type = 0; type < NUM_CELL_TYPES; type++) {
+        displace_mask[type] = 0;
+        if (cell_props[type].mobility == MOB_STATIC)
+            continue;
+        for (int other = 0; other < NUM_CELL_TYPES; other++) {
+            if ((cell_props[other].flags & CELL_DISPLACEABLE) && cell_props[other].density < cell_props[type].density)
+                displace_mask[type] |= 1 << other;
+        }
+    }
+
+    granular_types = granular_other = inert_types = 0;
+    for (int type = 0; type < NUM_CELL_TYPES; type++) {
+        if (cell_props[type].mobility == MOB_STATIC && !(cell_props[type].flags & CELL_EXPLOSIVE)) // Огонь – в burning_pass
+            inert_types |= 1 << type;
+        if (cell_props[type].mobility == MOB_POWDER && (displace_mask[type] >> EMPTY & 1)) {
+            granular_types |= 1 << type;
+            granular_other |= displace_mask[type] & ~(1u << EMPTY);
+        }
+    }
+
+    for (int near = 0; near < NEAR_MASKS; near++) {
+        move_rules[MOB_STATIC][near] = (MoveRule){0};
+        move_rules[MOB_POWDER][near] = powder_rule(near);
+        move_rules[MOB_LIQUID][near] = liquid_rule(near);
+    }
+
+    for (int near_flags = 0; near_flags < REACT_MASKS; near_flags++) {
+        react_rules[0][near_flags] = bomb_rule(near_flags);
+        react_rules[1][near_flags] = fire_rule(near_flags);
+    }
+}
+
+// Ставит бомбу IDX в очередь: она взорвётся в blasts_resolve после обхода. Одну бомбу можно поставить и
+// дважды (огонь с двух сторон, таймер), повторы отбрасываются там же
+static inline void blast_queue(CellsMap map, int idx) {
+    map.blasts->cells[__atomic_fetch_add(&map.blasts->len, 1, __ATOMIC_RELAXED)] = idx;
+}
+
+// Реакции неподвижных клеток с соседями: огонь горит и гаснет, бомба взрывается. Что делать, решает
+// таблица react_rules по объединению флагов соседей, а здесь реакция только выполняется. Огонь сюда
+// приходит из burning_pass, а бомба – из обхода чанков, когда её разбудило колесо таймеров
+void react_cell(CellsMap map, int x, int y) {
+    int current = y*map.width + x;
+    int top = (y-1)*map.width + x;
+    int bottom = (y+1)*map.width + x;
+    unsigned char type = map.types[current];
+    const CellProps *props = &cell_props[type];
+
+    int movements[8]; // Соседи, на которых может перекинуться огонь
+    int j = 0;
+
+    // Соседи в порядке: верхний ряд, слева, справа, нижний ряд. Бомбе смотреть на них незачем: её взрывает огонь
+    int neighbors[8];
+    int n = 0;
+    if (props->flags & CELL_BURNING) {
+        if (y > 0) {
+            neighbors[n++] = top;
+            if (x > 0) neighbors[n++] = top - 1;
+            if (x < map.width-1) neighbors[n++] = top + 1;
+        }
+        if (x > 0) neighbors[n++] = current - 1;
+        if (x < map.width-1) neighbors[n++] = current + 1;
+        if (y < map.height-1) {
+            neighbors[n++] = bottom;
+            if (x > 0) neighbors[n++] = bottom - 1;
+            if (x < map.width-1) neighbors[n++] = bottom + 1;
+        }
+    }
+
+    int near_flags = 0; // Объединение флагов всех соседей
+    for (int i = 0; i < n; i++) {
+        int flags = cell_props[map.types[neighbors[i]]].flags;
+        near_flags |= flags;
+        if (flags & CELL_FLAMMABLE)
+            movements[j++] = neighbors[i];
+    }
+
+    unsigned char reaction = react_rules[(props->flags & CELL_BURNING) != 0][near_flags];
+    if ((reaction & REACT_IGNITE_BOMBS) && (props->flags & CELL_IGNITES)) {
+        for (int i = 0; i < n; i++) {
+            if (cell_props[map.types[neighbors[i]]].flags & CELL_EXPLOSIVE)
+                blast_queue(map, neighbors[i]);
+        }
+    }
+    if ((reaction & REACT_KIND) == REACT_FUSE && fuse_elapsed(map, current) >= BOMB_FUSE)
+        reaction = REACT_DETONATE; // Таймер истёк
+
+    switch (reaction & REACT_KIND) {
+    case REACT_QUENCH:
+        set_type(map, current, EMPTY);
+        for (int i = 0; i < n; i++) {
+            if (cell_props[map.types[neighbors[i]]].flags & CELL_QUENCHES)
+                set_type(map, neighbors[i], cell_props[map.types[neighbors[i]]].becomes);
+        }
+        touch_around(map, x, y);
+        break;
+    case REACT_SPREAD: {
+        int r = rnd(100); // Вероятности ниже в процентах
+
+        if (r > 15) {
+            keep_awake(map, x, y);
+            break;
+        }
+        j = rnd(j); // Случайное число в диапазоне 0..j-1
+        set_type(map, movements[j], type);
+        burning_add(map, movements[j]); // Загорится только в следующем проходе огня
+        thread_counters.fire_spread++;
+        if (r < 6) {
+            set_type(map, current, (r < 4) ? props->becomes : type);
+        } else {
+            set_type(map, current, EMPTY);
+        }
+        touch_around(map, x, y);
+        break;
+    }
+    case REACT_BURN_OUT:
+        set_type(map, current, EMPTY);
+        touch_around(map, x, y);
+        break;
+    case REACT_FUSE:
+        if (!(map.timers[current] & FUSE_QUEUED)) // Огня рядом нет: до взрыва её разбудит колесо или огонь
+            fuse_schedule(map, current);
+        break;
+    case REACT_DETONATE:
+        blast_queue(map, current);
+        break;
+    }
+}
+
+// Проход огня: каждая клетка из множества горящих реагирует с соседями. Огонь не держит чанки проснувшимися,
+// а бомбы не ищут его вокруг себя, так что большое дерево с маленьким пожаром или склад бомб без огня
+// почти ничего не стоят. Идёт после обхода чанков в одном потоке, поэтому не зависит от числа потоков
+void burning_pass(CellsMap map) {
+    BurningSet *burning = map.burning;
+    if (burning->stale) {
+        burning_clear(map);
+        burning_scan(map, 0, 0, map.width-1, map.height-1);
+    }
+    if (burning->len == 0)
+        return;
+
+    rng_seed(&thread_rng, sim_seed ^ (update_passes * 0x100000001B3ULL + map.chunks_w*map.chunks_h + 2));
+
+    int len = burning->len; // Загоревшиеся в этом проходе добавляются в конец и ждут следующего
+    int kept = 0;
+    for (int i = 0; i < len; i++) {
+        int idx = burning->cells[i];
+        if (cell_props[map.types[idx]].flags & CELL_BURNING) {
+            thread_counters.visited++;
+            react_cell(map, idx % map.width, idx / map.width);
+        }
+        if (cell_props[map.types[idx]].flags & CELL_BURNING) // Догоревшие и затёртые выпадают из множества
+            burning->cells[kept++] = idx;
+        else
+            burning->listed[idx] = false;
+    }
+    memmove(&burning->cells[kept], &burning->cells[len], (burning->len - len) * sizeof(int));
+    burning->len = kept + burning->len - len;
+}
+
+int compare_int(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Смещение клетки от центра взрыва упаковывается в байт по полубайту на ось, ноль остаётся для незадетых клеток
+_Static_assert(2*BLAST_RADIUS + 1 < 16, "BLAST_RADIUS does not fit blast_offset");
+#define blast_offset(dx, dy) ((unsigned char)(((dy) + BLAST_RADIUS + 1) << 4 | ((dx) + BLAST_RADIUS)))
+#define blast_dx(offset) (((offset) & 15) - BLAST_RADIUS)
+#define blast_dy(offset) (((offset) >> 4) - BLAST_RADIUS - 1)
+
+// Чебышёвское расстояние до центра взрыва
+static inline int blast_distance(unsigned char offset) {
+    int dx = abs(blast_dx(offset)), dy = abs(blast_dy(offset));
+    return (dx > dy ? dx : dy);
+}
+
+// Взрывает все бомбы из очереди разом. Пересекающиеся взрывы сливаются: каждая задетая клетка разбирается один раз
+// по ближайшему к ней центру. Соседи центра становятся пустотой, следующее кольцо – огнём,
+// а клетки дальше отлетают от центра и оставляют огонь на своём месте
+void blasts_resolve(CellsMap map) {
+    BlastQueue *blasts = map.blasts;
+    if (blasts->len == 0)
+        return;
+
+    // В параллельном проходе порядок очереди и состояние генератора зависят от потоков, а результат не должен
+    qsort(blasts->cells, blasts->len, sizeof(int), compare_int);
+    int unique = 0;
+    for (int i = 0; i < blasts->len; i++) {
+        if (unique == 0 || blasts->cells[i] != blasts->cells[unique-1])
+            blasts->cells[unique++] = blasts->cells[i];
+    }
+    blasts->len = unique;
+    thread_counters.detonations += unique;
+    rng_seed(&thread_rng, sim_seed ^ (update_passes * 0x100000001B3ULL + map.chunks_w*map.chunks_h));
+
+    // Каждой задетой клетке – ближайший центр, при равенстве – тот, что раньше в очереди
+    for (int i = 0; i < blasts->len; i++) {
+        int x = blasts->cells[i] % map.width, y = blasts->cells[i] / map.width;
+        for (int cy = (y > BLAST_RADIUS ? y-BLAST_RADIUS : 0); cy <= y+BLAST_RADIUS && cy < map.height; cy++) {
+            for (int cx = (x > BLAST_RADIUS ? x-BLAST_RADIUS : 0); cx <= x+BLAST_RADIUS && cx < map.width; cx++) {
+                unsigned char *nearest = &blasts->nearest[cy*map.width + cx];
+                unsigned char offset = blast_offset(cx-x, cy-y);
+                if (*nearest == 0 || blast_distance(offset) < blast_distance(*nearest))
+                    *nearest = offset;
+            }
+        }
+    }
+
+    for (int i = 0; i < blasts->len; i++) {
+        int x = blasts->cells[i] % map.width, y = blasts->cells[i] / map.width;
+        for (int cy = (y > BLAST_RADIUS ? y-BLAST_RADIUS : 0); cy <= y+BLAST_RADIUS && cy < map.height; cy++) {
+            for (int cx = (x > BLAST_RADIUS ? x-BLAST_RADIUS : 0); cx <= x+BLAST_RADIUS && cx < map.width; cx++) {
+                int ncurrent = cy*map.width + cx;
+                unsigned char offset = blasts->nearest[ncurrent];
+                if (offset == 0) // Уже разобрана другим взрывом
+                    continue;
+                blasts->nearest[ncurrent] = 0;
+                if (chance(1, 6))
+                    continue;
+
+                int dx = blast_dx(offset), dy = blast_dy(offset);
+                int distance = blast_distance(offset);
+                if (distance <= 1) {
+                    set_type(map, ncurrent, EMPTY);
+                } else if (distance == 2) {
+                    set_type(map, ncurrent, FIRE);
+                    burning_add(map, ncurrent);
+                } else if (map.types[ncurrent] != EMPTY) {
+                    int nx = cx + sign(dx) * rnd(abs(dx)+4);
+                    int ny = cy + sign(dy) * rnd(abs(dy)+4);
+                    if (nx >= 0 && nx <= (map.width-1) && ny >= 0 && ny <= (map.height-1)) {
+                        int idx = (ny) * map.width + (nx);
+                        set_type(map, idx, map.types[ncurrent]);
+                        map.timers[idx] = 0;
+                        map.velocity[idx] = 0;
+                        blasts->nearest[idx] = 0; // Прежнюю клетку там уже затёрли, второй раз её не разбирать
+                        if (cell_props[map.types[idx]].flags & CELL_BURNING) // Отлетел сам огонь
+                            burning_add(map, idx);
+                        set_type(map, ncurrent, FIRE);
+                        burning_add(map, ncurrent);
+                        touch_around(map, nx, ny);
+                    }
+                }
+                map.timers[ncurrent] = 0;
+                map.velocity[ncurrent] = 0;
+            }
+        }
+        set_type(map, blasts->cells[i], EMPTY);
+        map.timers[blasts->cells[i]] = 0;
+        map_touch_rect(map, x-BLAST_RADIUS-1, y-BLAST_RADIUS-1, x+BLAST_RADIUS+1, y+BLAST_RADIUS+1);
+    }
+    blasts->len = 0;
+}
+
+// Клетка, которая падает отвесно, разгоняется на клетку за тик до MAX_FALL_SPEED и за тик пролетает столько
+// пустых клеток подряд, сколько позволяет скорость. IDX – клетка под ней, куда она уже может упасть, SPEED –
+// скорость с разгоном. Возвращает, где клетка остановится, а в SPEED кладёт её новую скорость (0 – приземлилась)
+static inline int fall_reach(CellsMap map, int idx, int *speed) {
+    if (map.types[idx] != EMPTY) { // Сквозь воду и пар – не быстрее, чем на клетку
+        *speed = 0;
+        return idx;
+    }
+
+    int size = map.width*map.height;
+    int fallen = 1;
+    int next = idx + map.width;
+    while (fallen < *speed && next < size && map.types[next] == EMPTY && map.updated[next] != update_stamp) {
+        idx = next;
+        next += map.width;
+        fallen++;
+    }
+    // Клетка, которая упёрлась в падающую перед ней, скорость не теряет: иначе падающая куча рассыпается на строки
+    bool landed = (next >= size || (map.types[next] != EMPTY && map.velocity[next] == 0));
+    *speed = (landed ? 0 : fallen);
+    map.updated[idx] = update_stamp; // Строки ниже уже пройдены, но в параллельном проходе чанк снизу может обновляться позже
+    return idx;
+}
+
+// Скорость после ещё одного тика падения
+#define fall_speed(map, idx) (map.velocity[idx] < MAX_FALL_SPEED ? map.velocity[idx] + 1 : MAX_FALL_SPEED)
+
+// Режим рассеивания: жидкость, которая сделала ход (DX, DY) вбок или по диагонали, продолжает течь, пока есть куда,
+// но не больше water_dispersion шагов: вниз, иначе по диагонали вниз, иначе вбок в ту же сторону.
+// Возвращает индекс клетки, где жидкость остановится
+int liquid_reach(CellsMap map, int x, int y, int dx, int dy, unsigned enter) {
+    int px = x+dx, py = y+dy;
+    for (int i = 1; i < water_dispersion; i++) {
+        bool below = (py+1 < map.height);
+        bool ahead = (dx != 0 && px+dx >= 0 && px+dx < map.width);
+        if (below && canenter(enter, (py+1)*map.width + px)) {
+            py++;
+        } else if (below && ahead && canenter(enter, (py+1)*map.width + px+dx)) {
+            px += dx;
+            py++;
+        } else if (ahead && canenter(enter, py*map.width + px+dx)) {
+            px += dx;
+        } else {
+            break;
+        }
+    }
+    return py*map.width + px;
+}
+
+// Обновляет одну клетку по правилам её типа и возвращает индекс, где она оказалась
+// (для клеток, которые не двигаются, это её же индекс)
+int update_cell(CellsMap map, int x, int y) {
+    int current = y*map.width + x;
+    int top = (y-1)*map.width + x;
+    int bottom = (y+1)*map.width + x;
+    unsigned char t;
+    unsigned char type = map.types[current];
+    const CellProps *props = &cell_props[type];
+    Mobility mobility = props->mobility;
+    unsigned enter = displace_mask[type]; // Типы клеток, место которых эта клетка может занять
+    int dispersion = water_dispersion; // Записи в карту байтовые, и без копии компилятор перечитывал бы её после каждой
+
+    int movements[8]; // Массив индексов клеток, куда можно переместиться (заполнены первые j)
+    int j = 0;
+    int moved_to = current; // Куда в итоге попала клетка
+    thread_counters.visited++;
+
+    switch (mobility) {
+    case MOB_STATIC: // Горящие клетки обновляет burning_pass
+        if (props->flags & CELL_EXPLOSIVE)
+            react_cell(map, x, y);
+        break;
+    case MOB_POWDER:
+    case MOB_LIQUID: {
+        // Маска соседей, куда можно сдвинуться. Если свободно снизу, остальное уже не важно
+        int near = 0;
+        if (y < map.height-1) {
+            near = canenter(enter, bottom) ? NEAR_B : 0;
+            if (!near) {
+                near |= (x > 0 && canenter(enter, bottom - 1)) ? NEAR_BL : 0;
+                near |= (x < map.width-1 && canenter(enter, bottom + 1)) ? NEAR_BR : 0;
+            }
+        }
+        if (mobility == MOB_LIQUID && !near) {
+            near |= (x > 0 && canenter(enter, current - 1)) ? NEAR_L : 0;
+            near |= (x < map.width-1 && canenter(enter, current + 1)) ? NEAR_R : 0;
+        }
+
+        if (!near)
+            break;
+
+        MoveRule rule = move_rules[mobility][near];
+
+        int dx = (rule.either ? (rnd(2) ? 1 : -1) : rule.dx);
+        int step = current + rule.dy*map.width + dx; // Первый шаг по правилу
+        int target = step;
+        int speed = 0;
+        if (dx == 0 && (mobility == MOB_POWDER || dispersion > 0)) { // В старом режиме вода падает по клетке
+            speed = fall_speed(map, current);
+            target = fall_reach(map, step, &speed);
+        } else if (mobility == MOB_LIQUID && dispersion > 0) {
+            target = liquid_reach(map, x, y, dx, rule.dy, enter);
+            if (target / map.width == y) // Чтобы в этой же строке не пройти ещё столько же
+                map.updated[target] = update_stamp;
+        }
+        if (target / map.width > y) // Строку ниже чанк снизу может обновлять позже, как в fall_reach
+            map.updated[target] = update_stamp;
+        if (target != step)
+            touch_around(map, target % map.width, target / map.width);
+        movecurrent(target);
+        map.velocity[target] = speed;
+        map.velocity[current] = 0;
+        if (rule.settle_gas && cell_props[map.types[current]].mobility == MOB_GAS)
+            map.updated[current] = update_stamp;
+        break;
+    }
+    case MOB_GAS:
+        if (!chance(1, props->inertia)) {
+            keep_awake(map, x, y);
+            break;
+        }
+
+        if (y > 0) {
+            if (canenter(enter, top)) movements[j++] = top;
+            if (x > 0 && canenter(enter, top - 1)) movements[j++] = top-1;
+            if (x < map.width-1 && canenter(enter, top + 1)) movements[j++] = top+1;
+        }
+
+        if (x > 0 && canenter(enter, current - 1)) movements[j++] = current-1;
+        if (x < map.width-1 && canenter(enter, current + 1)) movements[j++] = current+1;
+
+        if (y < map.height-1 && rnd(2)) {
+            if (canenter(enter, bottom)) movements[j++] = bottom;
+            if (x > 0 && canenter(enter, bottom - 1)) movements[j++] = bottom - 1;
+            if (x < map.width-1 && canenter(enter, bottom + 1)) movements[j++] = bottom + 1;
+        }
+
+        if (j > 0) {
+            j = rnd(j); // Случайное число в диапазоне 0..j-1
+            movecurrent(movements[j]);
+            if (movements[j] > bottom-1)
+                map.updated[movements[j]] = update_stamp;
+            if (movements[j] - map.width >= 0)
+                map.updated[movements[j] - map.width] = update_stamp;
+        }
+        break;
+    }
+
+    if (moved_to != current)
+        thread_counters.moved++;
+    return moved_to;
+}
+
+// Маска клеток, начиная с индекса IDX (не больше 64 подряд): бит k установлен, если тип клетки IDX+k
+// входит в набор TYPES и её ещё не обновляли в этом проходе, а если STAMPED – то если входит или уже обновлена
+uint64_t row_mask(CellsMap map, int idx, int n, unsigned types, bool stamped) {
+    uint64_t bits = 0;
+    int k = 0;
+#ifdef __SSE2__
+    __m128i stamp = _mm_set1_epi8((char)update_stamp);
+    for (; k + 16 <= n; k += 16) {
+        __m128i row = _mm_loadu_si128((const __m128i *)(map.types + idx + k));
+        __m128i in = _mm_setzero_si128();
+        for (unsigned set = types; set; set &= set - 1)
+            in = _mm_or_si128(in, _mm_cmpeq_epi8(row, _mm_set1_epi8((char)__builtin_ctz(set))));
+        __m128i done = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(map.updated + idx + k)), stamp);
+        in = (stamped ? _mm_or_si128(done, in) : _mm_andnot_si128(done, in));
+        bits |= (uint64_t)(unsigned)_mm_movemask_epi8(in) << k;
+    }
+#endif
+    for (; k < n; k++) {
+        bool in = (types >> map.types[idx + k] & 1), done = (map.updated[idx + k] == update_stamp);
+        bits |= (uint64_t)(stamped ? in || done : in && !done) << k;
+    }
+    return bits;
+}
+
+// Обновляет сыпучие клетки строки Y от X0 до X1 (часть строки одного чанка) целыми масками: все падения вниз
+// за раз, потом ходы по диагонали, где спор двух зёрен за одну клетку решает случайный бит.
+// Зёрна, которые могут упасть в воду или пар, и проигравшие спор остаются для update_cell.
+// Возвращает маску клеток, которые уже обновлены или которым нечего делать (бит x - x0)
+uint64_t granular_row(CellsMap map, int y, int x0, int x1) {
+    if (x0 > x1)
+        return 0;
+
+    // Бит k масок ниже – клетка x0-1+k, то есть с соседней клеткой по краям
+    int lo = (x0 > 0 ? x0-1 : 0);
+    int hi = (x1 < map.width-1 ? x1+1 : map.width-1);
+    int shift = lo - (x0-1);
+    uint64_t own = ((2ULL << (x1-x0)) - 1) << 1; // Только свои клетки, без соседних
+    uint64_t inert = row_mask(map, y*map.width + x0, x1-x0+1, inert_types, true) << 1; // Вместе с уже обновлёнными
+    uint64_t grain = row_mask(map, y*map.width + lo, hi-lo+1, granular_types, false) << shift & own;
+    if (grain == 0)
+        return inert >> 1;
+
+    uint64_t fall = 0, left = 0, right = 0;
+    if (y < map.height-1) {
+        uint64_t empty = row_mask(map, (y+1)*map.width + lo, hi-lo+1, 1u << EMPTY, false) << shift;
+        uint64_t other = row_mask(map, (y+1)*map.width + lo, hi-lo+1, granular_other, false) << shift;
+        grain &= ~(other | other << 1 | other >> 1);
+
+        fall = grain & empty;
+        empty &= ~fall;
+        left = grain & ~fall & empty << 1;
+        right = grain & ~fall & empty >> 1;
+
+        uint64_t both = left & right;
+        if (both) {
+            uint64_t coin = rng_next(&thread_rng);
+            coin = coin << 32 | rng_next(&thread_rng);
+            left &= ~both | coin;
+            right &= ~(both & coin);
+        }
+
+        uint64_t clash = (left >> 1) & (right << 1); // Клетки, куда хотят упасть сразу два зерна
+        if (clash) {
+            uint64_t coin = rng_next(&thread_rng);
+            coin = coin << 32 | rng_next(&thread_rng);
+            uint64_t lost = (clash & coin) << 1 | (clash & ~coin) >> 1;
+            left &= ~lost;
+            right &= ~lost;
+            grain &= ~lost;
+        }
+    }
+
+    int base = y*map.width + x0-1;
+    int deepest = (y+1)*map.width; // Самая нижняя клетка, куда упало зерно
+    for (uint64_t m = fall; m; m &= m-1) {
+        int i = base + __builtin_ctzll(m);
+        int speed = fall_speed(map, i);
+        int to = fall_reach(map, i + map.width, &speed);
+        if (to > deepest)
+            deepest = to;
+        map.types[to] = map.types[i];
+        map.types[i] = EMPTY;
+        map.velocity[to] = speed;
+        map.velocity[i] = 0;
+    }
+    // Как и в fall_reach: строка ниже может принадлежать чанку, который в параллельном
+    // проходе обновится позже, поэтому сдвинутое вбок зерно тоже помечается
+    for (uint64_t m = left; m; m &= m-1) {
+        int i = base + __builtin_ctzll(m);
+        map.types[i + map.width - 1] = map.types[i];
+        map.types[i] = EMPTY;
+        map.updated[i + map.width - 1] = update_stamp;
+        map.velocity[i + map.width - 1] = 0;
+        map.velocity[i] = 0;
+    }
+    for (uint64_t m = right; m; m &= m-1) {
+        int i = base + __builtin_ctzll(m);
+        map.types[i + map.width + 1] = map.types[i];
+        map.types[i] = EMPTY;
+        map.updated[i + map.width + 1] = update_stamp;
+        map.velocity[i + map.width + 1] = 0;
+        map.velocity[i] = 0;
+    }
+
+    uint64_t moved = fall | left | right;
+    if (moved) // Один прямоугольник на всех вместо touch_around на каждую клетку
+        map_touch_rect(map, x0-2 + __builtin_ctzll(moved), y-1, x0 + 63-__builtin_clzll(moved), deepest / map.width + 1);
+
+    thread_counters.visited += __builtin_popcountll(grain);
+    thread_counters.moved += __builtin_popcountll(moved);
+    return (grain | inert) >> 1;
+}
+
+// Добавляет клетку с водой в список, если её там ещё нет
+void water_list_add(WaterList *water, int idx) {
+    if (water->listed[idx])
+        return;
+
+    if (water->len == water->cap) {
+        int cap = (water->cap ? water->cap*2 : 256);
+        int *cells = realloc(water->cells, cap * sizeof(int));
+        if (cells == NULL) { // Не хватило памяти: проходы воды до конца тика пойдут по всей карте
+            water->stale = true;
+            return;
+        }
+        water->cells = cells;
+        water->cap = cap;
+    }
+    water->cells[water->len++] = idx;
+    water->listed[idx] = true;
+}
+
+// Пересобирает список воды по грязным прямоугольникам после основного прохода
+void water_list_rebuild(CellsMap map) {
+    WaterList *water = map.water;
+    for (int i = 0; i < water->len; i++)
+        water->listed[water->cells[i]] = false;
+    water->len = 0;
+    water->stale = false;
+
+    for (int i = 0; i < map.chunks_w*map.chunks_h; i++) {
+        Chunk *chunk = &map.chunks[i];
+        if (!chunk->awake)
+            continue;
+        for (int y = chunk->y0; y <= chunk->y1; y++) {
+            for (int x = chunk->x0; x <= chunk->x1; x++) {
+                if (map.types[y*map.width + x] == WATER)
+                    water_list_add(water, y*map.width + x);
+            }
+        }
+    }
+}
+
+// Проход только по воде из списка: строки снизу вверх, внутри строки в случайном порядке, как и в полном проходе
+void water_list_pass(CellsMap map) {
+    WaterList *water = map.water;
+
+    if (water->sorted_cap < water->len) {
+        int *sorted = realloc(water->sorted, water->cap * sizeof(int));
+        if (sorted == NULL) {
+            water->stale = true;
+            return;
+        }
+        water->sorted = sorted;
+        water->sorted_cap = water->cap;
+    }
+
+    // Раскладка списка по строкам подсчётом
+    memset(water->row_start, 0, (map.height+1) * sizeof(int));
+    for (int i = 0; i < water->len; i++)
+        water->row_start[map.height-1 - water->cells[i]/map.width + 1]++;
+    for (int r = 0; r < map.height; r++)
+        water->row_start[r+1] += water->row_start[r];
+    for (int i = 0; i < water->len; i++)
+        water->sorted[water->row_start[map.height-1 - water->cells[i]/map.width]++] = water->cells[i];
+    for (int r = map.height; r > 0; r--)
+        water->row_start[r] = water->row_start[r-1];
+    water->row_start[0] = 0;
+
+    water->len = 0; // Список собирается заново из тех, кто остался водой, и разбуженных соседей
+
+    // Зерно своё на каждый проход, как у чанков, чтобы поток, который делает проход, ни на что не влиял
+    rng_seed(&thread_rng, sim_seed ^ (update_passes * 0x100000001B3ULL + map.chunks_w*map.chunks_h + 1));
+
+    for (int r = 0; r < map.height; r++) {
+        int row_len = water->row_start[r+1] - water->row_start[r];
+        if (row_len == 0)
+            continue;
+        int *row = &water->sorted[water->row_start[r]];
+        if (row_len > 1)
+            shuffle(row, row_len);
+
+        for (int i = 0; i < row_len; i++) {
+            int current = row[i];
+            water->listed[current] = false;
+            if (map.types[current] != WATER)
+                continue;
+            if (map.updated[current] == update_stamp) {
+                water_list_add(water, current);
+                continue;
+            }
+
+            int x = current % map.width;
+            int y = current / map.width;
+            int moved_to = update_cell(map, x, y);
+            water_list_add(water, moved_to);
+
+            if (moved_to != current) { // Соседи освободившейся клетки теперь тоже могут потечь
+                for (int ny = y-1; ny <= y+1; ny++) {
+                    for (int nx = x-1; nx <= x+1; nx++) {
+                        if (nx >= 0 && nx < map.width && ny >= 0 && ny < map.height && \
+                            map.types[ny*map.width + nx] == WATER)
+                        {
+                            water_list_add(water, ny*map.width + nx);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Клетки строки Y чанка с левым краем CHUNK_X и шириной CHUNK_W, которым нужен update_cell (бит x - CHUNK_X),
+// если грязный прямоугольник чанка в этой строке – от X0 до X1. Сыпучие клетки прямоугольника заодно
+// обновляются через granular_row, а инертные и уже обновлённые в маску не попадают. Непустые клетки вне
+// прямоугольника тоже в маске: прямоугольник может дорасти до них по ходу строки, это проверяется при обходе
+uint64_t row_live(CellsMap map, int y, int chunk_x, int chunk_w, int x0, int x1, bool only_water) {
+    int idx = y*map.width + chunk_x;
+    if (only_water)
+        return row_mask(map, idx, chunk_w, 1u << WATER, false);
+
+    uint64_t rect = ((2ULL << (x1-x0)) - 1) << (x0 - chunk_x);
+    uint64_t all = (chunk_w < 64 ? (1ULL << chunk_w) - 1 : ~0ULL);
+    uint64_t live = ~granular_row(map, y, x0, x1) << (x0 - chunk_x) & rect;
+    if (live == 0 || rect == all)
+        return live;
+    return live | (~row_mask(map, idx, chunk_w, 1u << EMPTY, true) & all & ~rect);
+}
+
+// Обновляет клетки одного чанка внутри его грязного прямоугольника:
+// строки снизу вверх, внутри строки в случайном порядке
+void update_chunk(CellsMap map, int chunk_idx, bool only_water) {
+    Chunk *chunk = &map.chunks[chunk_idx];
+    if (!chunk->awake)
+        return;
+
+    int chunk_x = (chunk_idx % map.chunks_w) * CHUNK_SIZE;
+    int chunk_w = (map.width - chunk_x < CHUNK_SIZE ? map.width - chunk_x : CHUNK_SIZE);
+
+    // Случайность чанка зависит только от зерна, прохода и номера чанка, а не от того, какой поток его взял
+    rng_seed(&thread_rng, sim_seed ^ (update_passes * 0x100000001B3ULL + chunk_idx));
+
+    int cells[CHUNK_SIZE], places[CHUNK_SIZE];
+    Traversal order; // Порядок обработки клеток чанка
+    traversal_start(&order, chunk_w, cells, places);
+
+    // Прямоугольник может расти вверх прямо во время обхода, поэтому y0 перечитывается
+    for (int y = chunk->y1; y >= chunk->y0; y--) {
+        int x0 = chunk->x0;
+        int x1 = chunk->x1;
+        if (x0 > x1)
+            continue;
+        uint64_t live = row_live(map, y, chunk_x, chunk_w, x0, x1, only_water);
+        if (live == 0 && !only_water)
+            continue; // Всю строку уже разобрали маски
+
+        // Живые клетки раскладываются по местам в очереди строки и обходятся по возрастанию места
+        traversal_row(&order, y + update_passes);
+        uint64_t slots = 0;
+        for (; live; live &= live - 1)
+            slots |= 1ULL << traversal_place(&order, __builtin_ctzll(live));
+        for (; slots; slots &= slots - 1) {
+            int x = chunk_x + traversal_at(&order, __builtin_ctzll(slots));
+            if (x < chunk->x0 || x > chunk->x1)
+                continue;
+
+            int current = y*map.width + x;
+            if (map.updated[current] == update_stamp)
+                continue;
+            if (only_water && map.types[current] != WATER)
+                continue;
+
+            update_cell(map, x, y);
+        }
+    }
+}
+
+typedef struct ThreadPool ThreadPool;
+
+typedef struct {
+    ThreadPool *pool;
+    int id;
+    pthread_t thread;
+    unsigned long long range; // Свои задачи потока: младшие 32 бита – начало, старшие – конец
+} Worker;
+
+// Постоянный пул потоков для параллельного обновления. Вызывающий поток работает в нём под номером 0
+struct ThreadPool {
+    int count; // Количество потоков вместе с вызывающим
+    Worker *workers;
+    pthread_mutex_t mtx;
+    pthread_cond_t start_cnd; // Выдана новая фаза
+    pthread_cond_t done_cnd; // Все потоки закончили фазу
+    unsigned phase; // Номер текущей фазы, потоки ждут его смены
+    int busy; // Сколько потоков ещё не закончили фазу
+    bool quit;
+
+    // Текущая фаза
+    CellsMap map;
+    bool only_water;
+    int *tasks; // Индексы чанков
+};
+
+ThreadPool *update_pool = NULL; // Пул для параллельного обновления, NULL – обновление в одном потоке
+
+#define range_pack(begin, end) ((unsigned long long)(end) << 32 | (unsigned)(begin))
+
+// Берёт задачу из начала своей очереди
+int worker_pop(Worker *worker) {
+    unsigned long long range = __atomic_load_n(&worker->range, __ATOMIC_RELAXED);
+    for (;;) {
+        unsigned begin = range & 0xFFFFFFFF, end = range >> 32;
+        if (begin >= end)
+            return -1;
+        if (__atomic_compare_exchange_n(&worker->range, &range, range_pack(begin+1, end), true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return begin;
+    }
+}
+
+// Крадёт задачу с конца чужой очереди
+int worker_steal(Worker *victim) {
+    unsigned long long range = __atomic_load_n(&victim->range, __ATOMIC_RELAXED);
+    for (;;) {
+        unsigned begin = range & 0xFFFFFFFF, end = range >> 32;
+        if (begin >= end)
+            return -1;
+        if (__atomic_compare_exchange_n(&victim->range, &range, range_pack(begin, end-1), true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return end-1;
+    }
+}
+
+// Выполняет свои задачи фазы, а когда они кончаются, ворует у остальных
+void pool_work(ThreadPool *pool, int id) {
+    for (;;) {
+        int task = worker_pop(&pool->workers[id]);
+        for (int i = 1; task < 0 && i < pool->count; i++)
+            task = worker_steal(&pool->workers[(id + i) % pool->count]);
+        if (task < 0)
+            return;
+        update_chunk(pool->map, pool->tasks[task], pool->only_water);
+    }
+}
+
+void *pool_thread_loop(void *args) {
+    Worker *worker = args;
+    ThreadPool *pool = worker->pool;
+    unsigned seen = 0;
+
+    for (;;) {
+        // Фазы идут часто, поэтому сначала немного ждём без сна
+        for (int i = 0; i < POOL_SPIN && __atomic_load_n(&pool->phase, __ATOMIC_ACQUIRE) == seen; i++);
+
+        pthread_mutex_lock(&pool->mtx);
+        while (pool->phase == seen && !pool->quit)
+            pthread_cond_wait(&pool->start_cnd, &pool->mtx);
+        if (pool->quit) {
+            pthread_mutex_unlock(&pool->mtx);
+            break;
+        }
+        seen = pool->phase;
+        pthread_mutex_unlock(&pool->mtx);
+
+        pool_work(pool, worker->id);
+        counters_flush();
+        population_flush(pool->map);
+
+        if (__atomic_sub_fetch(&pool->busy, 1, __ATOMIC_ACQ_REL) == 0) {
+            pthread_mutex_lock(&pool->mtx);
+            pthread_cond_signal(&pool->done_cnd);
+            pthread_mutex_unlock(&pool->mtx);
+        }
+    }
+
+    return NULL;
+}
+
+// Создаёт пул из COUNT потоков (включая вызывающий)
+ThreadPool *pool_create(int count, int max_tasks) {
+    ThreadPool *pool = calloc(1, sizeof(ThreadPool));
+    if (pool == NULL)
+        return NULL;
+    pool->count = count;
+    pool->workers = calloc(count, sizeof(Worker));
+    pool->tasks = malloc(max_tasks * sizeof(int));
+    if (pool->workers == NULL || pool->tasks == NULL) {
+        free(pool->workers);
+        free(pool->tasks);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->mtx, NULL);
+    pthread_cond_init(&pool->start_cnd, NULL);
+    pthread_cond_init(&pool->done_cnd, NULL);
+
+    for (int i = 0; i < count; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        if (i > 0 && pthread_create(&pool->workers[i].thread, NULL, pool_thread_loop, &pool->workers[i]) != 0) {
+            pool->count = i; // Работаем с теми потоками, что успели создаться
+            break;
+        }
+    }
+
+    return pool;
+}
+
+void pool_destroy(ThreadPool *pool) {
+    pthread_mutex_lock(&pool->mtx);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->start_cnd);
+    pthread_mutex_unlock(&pool->mtx);
+
+    for (int i = 1; i < pool->count; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+
+    pthread_mutex_destroy(&pool->mtx);
+    pthread_cond_destroy(&pool->start_cnd);
+    pthread_cond_destroy(&pool->done_cnd);
+    free(pool->workers);
+    free(pool->tasks);
+    free(pool);
+}
+
+// Обновляет NTASKS чанков из pool->tasks всеми потоками пула и ждёт, пока они закончат
+void pool_run(ThreadPool *pool, int ntasks) {
+    if (ntasks <= 1 || pool->count == 1) { // Будить потоки ради одного чанка дороже, чем обновить его самому
+        for (int i = 0; i < ntasks; i++)
+            update_chunk(pool->map, pool->tasks[i], pool->only_water);
+        return;
+    }
+
+    for (int i = 0; i < pool->count; i++) {
+        int begin = ntasks * i / pool->count;
+        int end = ntasks * (i+1) / pool->count;
+        __atomic_store_n(&pool->workers[i].range, range_pack(begin, end), __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&pool->mtx);
+    __atomic_store_n(&pool->busy, pool->count-1, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->phase, pool->phase+1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->start_cnd);
+    pthread_mutex_unlock(&pool->mtx);
+
+    pool_work(pool, 0);
+
+    for (int i = 0; i < POOL_SPIN && __atomic_load_n(&pool->busy, __ATOMIC_ACQUIRE) > 0; i++);
+    pthread_mutex_lock(&pool->mtx);
+    while (__atomic_load_n(&pool->busy, __ATOMIC_ACQUIRE) > 0)
+        pthread_cond_wait(&pool->done_cnd, &pool->mtx);
+    pthread_mutex_unlock(&pool->mtx);
+}
+
+// Проход по чанкам: они раскрашены в шахматном порядке 2x2, и в каждой из четырёх фаз
+// обновляются только чанки одного цвета. Между одновременно обновляемыми чанками всегда лежит целый чанк,
+// поэтому ничто, до чего дотягивается клетка (BLAST_REACH), не достаёт до чужой области. Сами взрывы
+// разбираются уже после прохода, в blasts_resolve. Без пула чанки обходятся в том же порядке одним потоком,
+// а случайность у каждого чанка своя, так что результат не зависит от числа потоков
+void update_chunks(CellsMap map, bool only_water) {
+    ThreadPool *pool = update_pool;
+    if (pool != NULL) {
+        pool->map = map;
+        pool->only_water = only_water;
+    }
+
+    for (int phase = 0; phase < 4; phase++) {
+        int ntasks = 0;
+        int row_parity = (map.chunks_h-1 + phase/2) % 2; // Сначала ряды той же чётности, что и нижний
+        for (int cy = map.chunks_h-1; cy >= 0; cy--) {
+            if (cy % 2 != row_parity)
+                continue;
+            for (int cx = phase % 2; cx < map.chunks_w; cx += 2) {
+                int chunk_idx = cy*map.chunks_w + cx;
+                if (!map.chunks[chunk_idx].awake)
+                    continue;
+                if (pool != NULL)
+                    pool->tasks[ntasks++] = chunk_idx;
+                else
+                    update_chunk(map, chunk_idx, only_water);
             }
         }
+        if (pool != NULL)
+            pool_run(pool, ntasks);
+    }
+}
+
+void update(CellsMap map, bool only_water) {
+    if (only_water && population_of(map, WATER) == 0) // Воды нет: проходы воды ничего не сделают
+        return;
+    update_passes++;
+
+    // Метки проходов занимают байт, поэтому раз в 255 проходов старые метки стираются,
+    // чтобы случайно не совпасть с новыми
+    update_stamp = update_passes % 255 + 1;
+    if (update_stamp == 1)
+        plane_zero(map.updated, map.width*map.height);
+
+    // Проходы воды обходят только список живой воды, если карту не меняли в обход него
+    if (only_water && !map.water->stale) {
+        water_list_pass(map);
+        if (!map.water->stale) {
+            population_flush(map);
+            return;
+        }
+    }
+
+    // Грязные прямоугольники переключаются только в основном проходе, проходы воды дорабатывают тот же тик
+    if (!only_water) {
+        map_begin_tick(map);
+        fuses_advance(map);
     }
 
-    pthread_mutex_unlock(&map_mtx);
+    update_chunks(map, only_water);
+
+    if (!only_water) {
+        burning_pass(map);
+        blasts_resolve(map);
+    }
+    population_flush(map);
+    if (!only_water && water_dispersion == 0) // Список нужен только проходам воды старого режима
+        water_list_rebuild(map);
 }
 
 typedef struct {
@@ -457,15 +2943,195 @@ typedef struct {
     CellsMap *mp; // Структура с массивом ячеек
     bool sp; // Флаг квадратных пикселей
     bool hc; // Автоматически скрывать курсор
+    int tps; // Целевое количество тиков в секунду, чтобы рисовать зажатой кнопкой не чаще, чем идёт симуляция
 } InputThreadArgs;
 
 bool run = true;
-bool pause = false;
-bool step = false; // Сделать один шаг песочницы во время паузы
+bool paused = false; // Меняет только поток симуляции, когда до него доходит EDIT_PAUSE
 bool cellselect_open = false;
+unsigned long long sim_ticks = 0; // Сколько тиков сделал поток симуляции, выставляется, когда он заканчивает
+TickStats sim_stats; // Время тиков симуляции, пишет только поток симуляции
+Pacer sim_pacer; // Расписание тиков симуляции
 bool win_change = false;
 pthread_mutex_t cellselect_mtx;
 pthread_cond_t cellselect_cnd;
+#ifndef _WIN32
+int wakeup_pipe[2] = {-1, -1}; // Запись в этот пайп будит поток, который ждёт ввода
+#endif
+
+// Имена команд в файле записи
+const char *edit_names[] = {
+    [EDIT_PAINT] = "paint", [EDIT_CLEAR] = "clear", [EDIT_SAVE] = "save", [EDIT_LOAD] = "load",
+    [EDIT_PAUSE] = "pause", [EDIT_STEP] = "step", [EDIT_MENU] = "menu", [EDIT_CURSOR] = "cursor",
+};
+
+// Файл записи – текстовый: строка заголовка, а потом по строке на команду вида
+// "<тик> <команда> <type> <x0> <y0> <x1> <y1>". Последняя строка – "<тик> end"
+typedef struct {
+    FILE *file;
+    unsigned long long seed, passes; // Зерно и счётчик проходов на момент начала записи
+    int width, height; // Размер поля
+    int water; // Количество итераций воды за тик
+    int dispersion; // water_dispersion
+    OrderKind order; // traversal_order
+    unsigned long long tick; // Тик, на котором надо применить command
+    EditCommand command; // Следующая команда из записи
+    bool done; // Запись кончилась
+} Replay;
+
+FILE *record_file = NULL; // Куда записывать команды (NULL – не записывать)
+Replay replay; // Запись, которую повторяет симуляция (replay.file == NULL – повтора нет)
+
+// Записывает заголовок файла записи
+void record_header(FILE *file, int width, int height, int water_iterations) {
+    fprintf(file, "sandbox-replay %d seed %llu passes %llu world %dx%d water %d dispersion %d order %s\n", REPLAY_VERSION,
+            (unsigned long long)sim_seed, (unsigned long long)update_passes, width, height, water_iterations, water_dispersion,
+            order_names[traversal_order]);
+}
+
+// Записывает команду, применённую на тике TICK
+void record_command(FILE *file, unsigned long long tick, EditCommand command) {
+    fprintf(file, "%llu %s %d %d %d %d %d\n", tick, edit_names[command.kind], command.type,
+            command.x0, command.y0, command.x1, command.y1);
+}
+
+// Читает из записи следующую команду. Если запись кончилась или испорчена, ставит replay->done
+void replay_next(Replay *replay) {
+    char name[16];
+    int type = 0;
+    replay->done = true;
+    if (fscanf(replay->file, "%llu %15s", &replay->tick, name) != 2 || strcmp(name, "end") == 0)
+        return;
+    for (size_t i = 0; i < sizeof(edit_names)/sizeof(edit_names[0]); i++) {
+        if (strcmp(name, edit_names[i]) == 0) {
+            EditCommand *command = &replay->command;
+            command->kind = i;
+            replay->done = (fscanf(replay->file, "%d %d %d %d %d", &type, &command->x0, &command->y0, &command->x1, &command->y1) != 5);
+            command->type = type;
+            return;
+        }
+    }
+}
+
+// Открывает запись и читает её заголовок и первую команду
+bool replay_open(Replay *replay, const char *path) {
+    int version = 0;
+    char order[16];
+    replay->file = fopen(path, "r");
+    if (replay->file == NULL)
+        return false;
+    replay->order = NUM_ORDERS;
+    if (fscanf(replay->file, "sandbox-replay %d seed %llu passes %llu world %dx%d water %d dispersion %d order %15s", &version,
+               &replay->seed, &replay->passes, &replay->width, &replay->height, &replay->water, &replay->dispersion, order) == 8)
+    {
+        for (int i = 0; i < NUM_ORDERS; i++) {
+            if (strcmp(order, order_names[i]) == 0)
+                replay->order = i;
+        }
+    }
+    if (replay->order == NUM_ORDERS || version != REPLAY_VERSION || \
+        replay->width <= 0 || replay->height <= 0 || replay->width > USHRT_MAX || replay->height > USHRT_MAX)
+    {
+        fclose(replay->file);
+        replay->file = NULL;
+        return false;
+    }
+    replay_next(replay);
+    return true;
+}
+
+// Состояние симуляции, которое меняют команды
+typedef struct {
+    unsigned long long tick; // Номер тика. Тики идут и на паузе, чтобы команды при повторе ложились туда же
+    bool step; // Сделать один шаг песочницы во время паузы
+    bool menu_open; // Пока открыто меню выбора клеток, игра стоит на паузе
+    Cursor *curs; // Курсор, который двигает повтор записи (NULL без интерфейса)
+} SimState;
+
+// Применяет одну команду
+void sim_apply(SimState *state, CellsMap *map, EditCommand command) {
+    switch (command.kind) {
+    case EDIT_PAUSE:
+        paused ^= 1;
+        break;
+    case EDIT_STEP:
+        state->step = true;
+        break;
+    case EDIT_MENU:
+        state->menu_open = command.type;
+        break;
+    case EDIT_CURSOR: // Живой курсор двигает поток ввода, а этот – только при повторе записи
+        if (replay.file != NULL && state->curs != NULL) {
+            curs_lock();
+            state->curs->x = (command.x0 < map->width ? command.x0 : map->width-1);
+            state->curs->y = (command.y0 < map->height ? command.y0 : map->height-1);
+            state->curs->brush = (command.type < NUM_CELL_TYPES ? command.type : SAND);
+            state->curs->brush_size = command.x1;
+            view_follow(state->curs, *map);
+            pthread_mutex_unlock(&curs_mtx);
+        }
+        break;
+    default:
+        map_apply_edit(map, command);
+        break;
+    }
+}
+
+// Начинает тик: применяет все команды, которые успели прийти из потока ввода, или, при повторе, команды
+// этого тика из записи. Поэтому правки всегда ложатся между тиками и в том порядке, в котором их сделали.
+// Возвращает false, когда повтор записи закончился
+bool sim_begin_tick(SimState *state, CellsMap *map) {
+    EditCommand command;
+    while (edit_ring_pop(&edits, &command)) {
+        if (replay.file != NULL) // При повторе поле меняет только запись
+            continue;
+        if (record_file != NULL && command.kind != EDIT_SAVE) // Сохранение ход симуляции не меняет
+            record_command(record_file, state->tick, command);
+        sim_apply(state, map, command);
+    }
+
+    while (replay.file != NULL && !replay.done && replay.tick <= state->tick) {
+        sim_apply(state, map, replay.command);
+        replay_next(&replay);
+    }
+    if (replay.file != NULL && replay.done && replay.tick <= state->tick)
+        return false;
+
+    map_release_loader(map);
+    return true;
+}
+
+// Надо ли на этом тике обновлять поле. Сбрасывает шаг во время паузы
+bool sim_should_update(SimState *state) {
+    bool update = (!paused || state->step) && !state->menu_open;
+    if (update)
+        state->step = false;
+    return update;
+}
+
+// Будит того, кто ждёт ввода в input_wait. Можно вызывать из обработчика сигнала
+void input_wakeup(void) {
+    #ifndef _WIN32
+        char byte = 0;
+        if (wakeup_pipe[1] != -1 && write(wakeup_pipe[1], &byte, 1) < 0) {
+            // Пайп переполнен, значит, ждущий и так проснётся
+        }
+    #endif
+}
+
+// Ждёт, пока на stdin не появится ввод, кто-нибудь не вызовет input_wakeup или не пройдёт TIMEOUT_MS миллисекунд
+// (-1 – ждать сколько угодно)
+void input_wait(int timeout_ms) {
+    #ifdef _WIN32
+        WaitForSingleObject(GetStdHandle(STD_INPUT_HANDLE), (timeout_ms < 0 ? INFINITE : (DWORD)timeout_ms));
+    #else
+        struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {wakeup_pipe[0], POLLIN, 0}}; // Отрицательный fd poll пропускает
+        if (poll(fds, 2, timeout_ms) > 0 && (fds[1].revents & POLLIN)) {
+            char buf[64];
+            while (read(wakeup_pipe[0], buf, sizeof(buf)) > 0);
+        }
+    #endif
+}
 
 // Функция обработки ввода в отдельном потоке
 void *input_thread_loop(void *args) {
@@ -473,16 +3139,35 @@ void *input_thread_loop(void *args) {
     CellsMap *map = ((InputThreadArgs *)args)->mp;
     bool square_pixels = ((InputThreadArgs *)args)->sp;
     bool auto_hide = ((InputThreadArgs *)args)->hc;
+    int target_tps = ((InputThreadArgs *)args)->tps;
 
     bool button1 = false; // Нажата ли ЛКМ
     bool button2 = false; // Нажато ли колёсико мыши
     bool space = false; // Был ли нажат пробел
 
-    unsigned timer = 0;
+    struct timespec last_action; // Когда курсор последний раз двигали или им рисовали
+    clock_gettime(CLOCK_MONOTONIC, &last_action);
+
+    Cursor recorded = *curs; // Курсор, который последним попал в запись
 
     do {
         int c = getch();
 
+        if (c == ERR) { // Ввода нет: спим, пока он не появится, вместо того чтобы крутиться в цикле
+            int timeout_ms = -1;
+            if (button1 || button2) { // Пока кнопка зажата, кисть рисует каждый тик
+                timeout_ms = (target_tps > 0 ? 1000 / target_tps : 1);
+                if (timeout_ms < 1) timeout_ms = 1; // Больше 1000 TPS: 1000 / TPS даёт 0, и поток крутился бы без сна
+            } else if (auto_hide && !curs->hide) { // Проснуться, когда курсор пора прятать
+                struct timespec now;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                timeout_ms = AUTO_HIDE_MS - elapsed_ns(last_action, now) / 1000000;
+                if (timeout_ms < 0) timeout_ms = 0;
+            }
+            input_wait(timeout_ms);
+            c = getch();
+        }
+
         MEVENT event;
         switch (c) {
         case 'q':
@@ -490,37 +3175,51 @@ void *input_thread_loop(void *args) {
             break;
         case KEY_UP:
             if (curs->y > 0) {
-                pthread_mutex_lock(&curs_mtx);
+                curs_lock();
                 curs->y--;
+                view_follow(curs, *map);
                 pthread_mutex_unlock(&curs_mtx);
             }
             break;
         case KEY_DOWN:
             if (curs->y < (map->height-1)) {
-                pthread_mutex_lock(&curs_mtx);
+                curs_lock();
                 curs->y++;
+                view_follow(curs, *map);
                 pthread_mutex_unlock(&curs_mtx);
             }
             break;
         case KEY_RIGHT:
             if (curs->x < (map->width-1)) {
-                pthread_mutex_lock(&curs_mtx);
+                curs_lock();
                 curs->x++;
+                view_follow(curs, *map);
                 pthread_mutex_unlock(&curs_mtx);
             }
             break;
         case KEY_LEFT:
             if (curs->x > 0) {
-                pthread_mutex_lock(&curs_mtx);
+                curs_lock();
                 curs->x--;
+                view_follow(curs, *map);
                 pthread_mutex_unlock(&curs_mtx);
             }
             break;
+        case 'w':
+        case 'a':
+        case 's':
+        case 'd':
+            curs_lock();
+            view_pan(curs, *map, (c == 'd') - (c == 'a'), (c == 's') - (c == 'w'));
+            pthread_mutex_unlock(&curs_mtx);
+            break;
         case KEY_MOUSE:
             if (getmouse(&event) == OK) {
-                pthread_mutex_lock(&curs_mtx);
-                if (event.x > 0 && (event.x) / (1+square_pixels) < map->width) curs->x = (event.x-1) / (1+square_pixels);
-                if (event.y > 0 && event.y < map->height+1) curs->y = event.y-1;
+                curs_lock();
+                int mouse_x = view.x + (event.x-1) / (1+square_pixels); // Координаты мышки на поле
+                int mouse_y = view.y + event.y-1;
+                if (event.x > 0 && mouse_x < view.x + view.width && mouse_x < map->width) curs->x = mouse_x;
+                if (event.y > 0 && mouse_y < view.y + view.height && mouse_y < map->height) curs->y = mouse_y;
 
                 if (event.bstate == BUTTON1_PRESSED) {
                     button1 = true;
@@ -548,82 +3247,99 @@ void *input_thread_loop(void *args) {
             space = true;
             break;
         case 'c':
-            pthread_mutex_lock(&map_mtx);
-            memset(map->cells, EMPTY, sizeof(Cell) * map->width*map->height);
-            pthread_mutex_unlock(&map_mtx);
+            edit_ring_push(&edits, (EditCommand){.kind = EDIT_CLEAR});
+            break;
+        case KEY_F(5):
+            edit_ring_push(&edits, (EditCommand){.kind = EDIT_SAVE});
+            break;
+        case KEY_F(9):
+            edit_ring_push(&edits, (EditCommand){.kind = EDIT_LOAD});
+            break;
+        case KEY_F(3):
+            show_profile ^= 1;
             break;
         case '+':
             if (curs->brush_size < 99) {
-                pthread_mutex_lock(&curs_mtx);
+                curs_lock();
                 curs->brush_size++;
                 pthread_mutex_unlock(&curs_mtx);
             }
             break;
         case '-':
             if (curs->brush_size > 1) {
-                pthread_mutex_lock(&curs_mtx);
+                curs_lock();
                 curs->brush_size--;
                 pthread_mutex_unlock(&curs_mtx);
             }
             break;
         case '\t':
+            edit_ring_push(&edits, (EditCommand){.kind = EDIT_MENU, .type = 1});
             cellselect_open = true;
             pthread_mutex_lock(&cellselect_mtx);
             while (cellselect_open) {
                 pthread_cond_wait(&cellselect_cnd, &cellselect_mtx);
             }
             pthread_mutex_unlock(&cellselect_mtx);
+            edit_ring_push(&edits, (EditCommand){.kind = EDIT_MENU, .type = 0});
             break;
         case 'p':
-            pause ^= 1;
+            edit_ring_push(&edits, (EditCommand){.kind = EDIT_PAUSE});
             break;
         case '\n':
         case '\r':
         case KEY_ENTER:
-            step = true;
+            edit_ring_push(&edits, (EditCommand){.kind = EDIT_STEP});
             break;
         case KEY_RESIZE:
             win_change = true;
             break;
         case 'h':
-            pthread_mutex_lock(&curs_mtx);
+            curs_lock();
             curs->hide ^= 1;
             pthread_mutex_unlock(&curs_mtx);
             break;
         default:
             if (isdigit(c) && (c-'0' < NUM_CELL_TYPES)) {
-                pthread_mutex_lock(&curs_mtx);
+                curs_lock();
                 curs->brush = c - '0';
                 pthread_mutex_unlock(&curs_mtx);
             }
             break;
         }
 
-        if (button1 || button2 || space) {
-            int y = curs->y-(curs->brush_size/(2-square_pixels) - square_pixels);
-            if (y < 0) y = 0;
-
-            pthread_mutex_lock(&map_mtx);
-            for (; y <= curs->y+(curs->brush_size/(2-square_pixels) - square_pixels) && y <= (map->height-1); y++) {
-                int x = curs->x-curs->brush_size+1;
-                if (x < 0) x = 0;
-                for (; x <= curs->x+curs->brush_size-1 && x <= (map->width-1); x++) {
-                    map->cells[y*map->width + x].type = (button2 ? EMPTY : curs->brush);
-                }
+        if (record_file != NULL) { // В запись курсор попадает перед правками, которые им сделаны
+            curs_lock();
+            Cursor now = *curs;
+            pthread_mutex_unlock(&curs_mtx);
+            if (now.x != recorded.x || now.y != recorded.y || now.brush != recorded.brush || now.brush_size != recorded.brush_size) {
+                edit_ring_push(&edits, (EditCommand){.kind = EDIT_CURSOR, .type = now.brush, .x0 = now.x, .y0 = now.y, .x1 = now.brush_size});
+                recorded = now;
             }
-            pthread_mutex_unlock(&map_mtx);
+        }
+
+        if (button1 || button2 || space) {
+            EditCommand paint = {
+                .kind = EDIT_PAINT,
+                .type = (button2 ? EMPTY : curs->brush),
+                .x0 = curs->x-curs->brush_size+1,
+                .y0 = curs->y-(curs->brush_size/(2-square_pixels) - square_pixels),
+                .x1 = curs->x+curs->brush_size-1,
+                .y1 = curs->y+(curs->brush_size/(2-square_pixels) - square_pixels),
+            };
+            edit_ring_push(&edits, paint);
 
             space = false;
         }
 
         if (auto_hide) {
-            pthread_mutex_lock(&curs_mtx);
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            curs_lock();
             if (c == KEY_MOUSE || c == '+' || c == '-' || c == ' ' || (c >= KEY_DOWN && c <= KEY_RIGHT) || button1 || button2 || space) {
-                timer = 0;
+                last_action = now;
                 curs->hide = false;
-            } else {
-                if (timer < 500000) timer++;
-                else curs->hide = true;
+            } else if (elapsed_ns(last_action, now) >= AUTO_HIDE_MS * (NS / 1000)) {
+                curs->hide = true;
             }
             pthread_mutex_unlock(&curs_mtx);
         }
@@ -633,9 +3349,347 @@ void *input_thread_loop(void *args) {
     return NULL;
 }
 
+typedef struct {
+    CellsMap *mp;
+    Cursor *cr; // Курсор, который двигает повтор записи
+    Snapshots *sn; // Куда публиковать снимки поля для отрисовки
+    int tps; // Целевое количество тиков в секунду
+    int wi; // Количество итераций воды за тик
+} SimThreadArgs;
+
+// Функция симуляции в отдельном потоке: обновляет поле с частотой TPS и публикует снимки для отрисовки,
+// никогда не дожидаясь вывода на экран
+void *sim_thread_loop(void *args) {
+    CellsMap *map = ((SimThreadArgs *)args)->mp;
+    SimState state = {.curs = ((SimThreadArgs *)args)->cr};
+    Snapshots *snaps = ((SimThreadArgs *)args)->sn;
+    int target_tps = ((SimThreadArgs *)args)->tps;
+    int water_iterations = ((SimThreadArgs *)args)->wi;
+
+    rng_seed(&thread_rng, sim_seed ^ (update_passes * 0x100000001B3ULL)); // Поле могли загрузить из сохранения
+    pacer_start(&sim_pacer, target_tps, MAX_CATCHUP);
+
+    do {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        if (!sim_begin_tick(&state, map)) { // Команды применяются в начале тика, даже на паузе
+            run = false;
+            input_wakeup();
+            break;
+        }
+
+        long long update_ns = 0, water_ns = 0;
+        if (sim_should_update(&state)) {
+            struct timespec update_start, middle;
+            clock_gettime(CLOCK_MONOTONIC, &update_start);
+            update(*map, false);
+            clock_gettime(CLOCK_MONOTONIC, &middle);
+            for (int i = 0; i < water_iterations-1; i++)
+                update(*map, true);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            update_ns = elapsed_ns(update_start, middle);
+            water_ns = elapsed_ns(middle, end);
+        }
+
+        snapshot_publish(snaps, *map); // Даже на паузе: кисть могла изменить поле
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        tick_stats_add(&sim_stats, start, end);
+        profile_tick(*map, update_ns, water_ns, &sim_stats);
+        pacer_wait(&sim_pacer);
+        state.tick++;
+    } while (run);
+
+    if (record_file != NULL)
+        fprintf(record_file, "%llu end\n", state.tick);
+    sim_ticks = state.tick;
+    profile_sample(*map, &sim_stats); // Последний, неполный интервал
+
+    return NULL;
+}
+
+// Количество доступных ядер процессора
+int cpu_count(void) {
+    #ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return info.dwNumberOfProcessors;
+    #else
+        long count = sysconf(_SC_NPROCESSORS_ONLN);
+        return (count > 0 ? count : 1);
+    #endif
+}
+
+// Забирает значение опции из следующего аргумента командной строки (NULL, если аргументов больше нет)
+#define option_value() (argc > 1 ? (argc--, *(++argv)) : NULL)
+
+// Разбирает число VALUE_STR для опции OPTION, при ошибке сообщает о ней
+bool parse_number(const char *prog, const char *option, const char *value_str, unsigned long long *value) {
+    if (value_str == NULL) {
+        fprintf(stderr, "%s: no value for option '%s'\n", prog, option);
+        return false;
+    }
+
+    char *endp;
+    errno = 0;
+    *value = strtoull(value_str, &endp, 10);
+    if (*endp != '\0' || !isdigit((unsigned char)*value_str) || errno == ERANGE) { // strtoull пропустил бы пробелы и минус
+        fprintf(stderr, "%s: illegal value '%s' for option '%s'\n", prog, value_str, option);
+        return false;
+    }
+    return true;
+}
+
+// Разбирает размер вида WxH для опции OPTION
+bool parse_size(const char *prog, const char *option, const char *value_str, int *width, int *height) {
+    if (value_str == NULL) {
+        fprintf(stderr, "%s: no value for option '%s'\n", prog, option);
+        return false;
+    }
+
+    char *endp;
+    unsigned long w = strtoul(value_str, &endp, 10);
+    unsigned long h = 0;
+    if (*endp == 'x')
+        h = strtoul(endp+1, &endp, 10);
+    if (*endp != '\0' || w == 0 || h == 0 || w > USHRT_MAX || h > USHRT_MAX) {
+        fprintf(stderr, "%s: illegal value '%s' for option '%s'\n", prog, value_str, option);
+        return false;
+    }
+
+    *width = w;
+    *height = h;
+    return true;
+}
+
+typedef struct {
+    int width, height;
+    unsigned long long ticks;
+    const char *scenario;
+    ChunkLoader *load; // Сохранение, с которого начать вместо сценария
+    const char *replay; // Запись, которую повторить вместо сценария (сама она в replay)
+} Benchmark; // Параметры замера скорости без терминала
+
+typedef struct {
+    uint64_t checksum;
+    long long population[NUM_CELL_TYPES];
+} BenchResult; // Чем кончился прогон, для сравнения прогонов между собой
+
+// Куча песка, которая осыпается на пол
+void scenario_sand_pile(CellsMap map) {
+    for (int y = 0; y < map.height/2; y++) {
+        for (int x = map.width/4; x < map.width*3/4; x++)
+            map.types[y*map.width + x] = SAND;
+    }
+}
+
+// Каменный бак с водой, из которого она вытекает через дыру в дне
+void scenario_water_tank(CellsMap map) {
+    int x0 = map.width/8, x1 = map.width*7/8;
+    int y0 = map.height/8, y1 = map.height*3/4;
+
+    for (int y = y0; y <= y1; y++) {
+        map.types[y*map.width + x0] = STONE;
+        map.types[y*map.width + x1] = STONE;
+    }
+    for (int x = x0; x <= x1; x++) {
+        if (abs(x - map.width/2) > 1)
+            map.types[y1*map.width + x] = STONE;
+    }
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0+1; x < x1; x++)
+            map.types[y*map.width + x] = WATER;
+    }
+}
+
+// Лес с просветами, который поджигают сверху в нескольких местах
+void scenario_forest_fire(CellsMap map) {
+    for (int y = map.height/3; y < map.height; y++) {
+        for (int x = 0; x < map.width; x++) {
+            if (chance(3, 4))
+                map.types[y*map.width + x] = WOOD;
+        }
+    }
+    for (int i = 1; i <= 5; i++)
+        map.types[(map.height/3 - 1)*map.width + map.width*i/6] = FIRE;
+}
+
+// Поле бомб вперемешку с песком и камнями
+void scenario_bomb_field(CellsMap map) {
+    for (int y = map.height/2; y < map.height; y++) {
+        for (int x = 0; x < map.width; x++) {
+            int r = rnd(8);
+            map.types[y*map.width + x] = (r == 0 ? BOMB : r == 1 ? STONE : r < 4 ? SAND : EMPTY);
+        }
+    }
+}
+
+const struct {
+    const char *name;
+    void (*fill)(CellsMap map);
+} scenarios[] = {
+    {"sand_pile", scenario_sand_pile},
+    {"water_tank", scenario_water_tank},
+    {"forest_fire", scenario_forest_fire},
+    {"bomb_field", scenario_bomb_field},
+};
+
+// Прогоняет сценарий без терминала и печатает скорость симуляции. Если RESULT не NULL, туда пишется итог
+int run_benchmark(const char *prog, Benchmark bench, int water_iterations, int threads, BenchResult *result) {
+    void (*fill)(CellsMap map) = NULL;
+    for (size_t i = 0; i < sizeof(scenarios)/sizeof(scenarios[0]); i++) {
+        if (strcmp(bench.scenario, scenarios[i].name) == 0)
+            fill = scenarios[i].fill;
+    }
+    if (replay.file != NULL) { // Запись начинается с пустого поля или с сохранения и идёт до конца
+        bench.width = replay.width;
+        bench.height = replay.height;
+        bench.scenario = bench.replay;
+        bench.ticks = ULLONG_MAX;
+    } else if (bench.load != NULL) {
+        bench.width = bench.load->header.width;
+        bench.height = bench.load->header.height;
+        bench.scenario = save_path;
+    } else if (fill == NULL) {
+        fprintf(stderr, "%s: unknown scenario '%s'\n", prog, bench.scenario);
+        return 1;
+    }
+
+    CellsMap map;
+    if (!map_create(&map, bench.width, bench.height)) {
+        map_destroy(&map);
+        fprintf(stderr, "%s: error allocating memory\n", prog);
+        return 1;
+    }
+    if (threads > 1)
+        update_pool = pool_create(threads, map.chunks_w*map.chunks_h);
+
+    struct timespec load_start, load_end;
+    clock_gettime(CLOCK_MONOTONIC, &load_start);
+    if (bench.load != NULL) {
+        map_load(&map, bench.load);
+    } else if (fill != NULL && replay.file == NULL) {
+        fill(map);
+        population_scan(map, map.population); // Сценарии пишут клетки напрямую
+        map_touch_rect(map, 0, 0, map.width-1, map.height-1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &load_end);
+
+    if (replay.file != NULL) {
+        sim_seed = replay.seed;
+        update_passes = replay.passes;
+        rng_seed(&thread_rng, sim_seed ^ (update_passes * 0x100000001B3ULL));
+    }
+
+    SimState state = {0};
+    TickStats tick_stats = {0};
+    long long main_ns = 0, water_ns = 0;
+    unsigned long long updated = 0; // Тики, в которых поле обновлялось: на паузе в записи время не замеряется
+    for (; state.tick < bench.ticks; state.tick++) {
+        struct timespec start, middle, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (!sim_begin_tick(&state, &map))
+            break;
+        if (!sim_should_update(&state))
+            continue;
+        update(map, false);
+        clock_gettime(CLOCK_MONOTONIC, &middle);
+        for (int i = 0; i < water_iterations-1; i++)
+            update(map, true);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        updated++;
+
+        main_ns += elapsed_ns(start, middle);
+        water_ns += elapsed_ns(middle, end);
+        tick_stats_add(&tick_stats, start, end);
+        profile_tick(map, elapsed_ns(start, middle), elapsed_ns(middle, end), &tick_stats);
+    }
+
+    bench.ticks = state.tick;
+    profile_sample(map, &tick_stats);
+    long long total_ns = main_ns + water_ns;
+    if (total_ns == 0) total_ns = 1;
+    printf("scenario:             %s, %dx%d, %llu ticks, water %d, dispersion %d, order %s, threads %d, seed %llu\n",
+           bench.scenario, map.width, map.height, bench.ticks, water_iterations, water_dispersion,
+           order_names[traversal_order], (update_pool ? update_pool->count : 1), (unsigned long long)sim_seed);
+    if (bench.load != NULL)
+        printf("load:                 %.3f ms\n", elapsed_ns(load_start, load_end) / 1e6);
+    if (updated < bench.ticks)
+        printf("paused:               %llu ticks, not counted in the rates below\n", bench.ticks - updated);
+    if (updated > 0) { // Запись может кончиться и раньше первого тика или идти на паузе
+        printf("ticks/sec:            %.1f\n", updated * (double)NS / total_ns);
+        printf("ns per cell per tick: %.3f\n", (double)total_ns / updated / ((double)map.width*map.height));
+        printf("main pass:            %.3f ms/tick (%.1f%%)\n", main_ns / 1e6 / updated, 100.0 * main_ns / total_ns);
+        printf("water passes:         %.3f ms/tick (%.1f%%)\n", water_ns / 1e6 / updated, 100.0 * water_ns / total_ns);
+    }
+    printf("checksum:             %016llx\n", (unsigned long long)map_checksum(map));
+
+    // Население, которое велось по ходу симуляции, должно совпасть с тем, что на поле на самом деле
+    int status = 0;
+    long long counted[NUM_CELL_TYPES];
+    map_decode_rect(map, 0, 0, map.width-1, map.height-1);
+    population_scan(map, counted);
+    for (int i = 0; i < NUM_CELL_TYPES; i++) {
+        if (counted[i] != map.population[i]) {
+            fprintf(stderr, "%s: population of %s is %lld, but the map has %lld\n",
+                    prog, cell_type_names[i], map.population[i], counted[i]);
+            status = 1;
+        }
+    }
+    if (result != NULL) {
+        result->checksum = map_checksum(map);
+        memcpy(result->population, map.population, sizeof(result->population));
+    }
+
+    if (update_pool != NULL) {
+        pool_destroy(update_pool);
+        update_pool = NULL;
+    }
+    map_destroy(&map);
+
+    return status;
+}
+
+// Прогоняет каждый сценарий в одном потоке и в THREADS потоках с одним и тем же зерном:
+// поле и население должны получиться одинаковыми
+int run_thread_check(const char *prog, Benchmark bench, int water_iterations, int threads) {
+    int status = 0;
+    for (size_t i = 0; i < sizeof(scenarios)/sizeof(scenarios[0]); i++) {
+        bench.scenario = scenarios[i].name;
+        BenchResult serial, parallel;
+        int counts[2] = {1, threads};
+        BenchResult *results[2] = {&serial, &parallel};
+        for (int k = 0; k < 2; k++) {
+            update_passes = 0;
+            rng_seed(&thread_rng, sim_seed);
+            if (run_benchmark(prog, bench, water_iterations, counts[k], results[k]) != 0)
+                status = 1;
+        }
+
+        bool same = serial.checksum == parallel.checksum;
+        for (int t = 0; t < NUM_CELL_TYPES; t++) {
+            if (serial.population[t] != parallel.population[t]) {
+                fprintf(stderr, "%s: %s: population of %s is %lld with 1 thread, but %lld with %d\n", prog,
+                        bench.scenario, cell_type_names[t], serial.population[t], parallel.population[t], threads);
+                same = false;
+            }
+        }
+        if (serial.checksum != parallel.checksum) {
+            fprintf(stderr, "%s: %s: checksum is %016llx with 1 thread, but %016llx with %d\n", prog, bench.scenario,
+                    (unsigned long long)serial.checksum, (unsigned long long)parallel.checksum, threads);
+        }
+        printf("%-21s %s\n\n", bench.scenario, (same ? "1 thread = threads" : "MISMATCH"));
+        if (!same)
+            status = 1;
+    }
+    return status;
+}
+
 #ifdef SIGWINCH
 void signal_win_change(void) {
     win_change = true;
+    input_wakeup();
 }
 #endif
 
@@ -666,9 +3720,14 @@ int main(int argc, char *argv[]) {
     #endif
 
     char *prog = argv[0];
+    rules_init();
 
     int target_tps = DEFAULT_TARGET_TPS;
-    int water_iterations = DEFAULT_WATER_ITERATIONS;
+    int target_fps = DEFAULT_TARGET_FPS;
+    int water_iterations = 1; // Проходов за тик: больше одного только в старом режиме воды
+    int threads = 1; // Количество потоков для обновления карты
+    int world_width = 0, world_height = 0; // Размер поля, если он задан опцией --world
+    sim_seed = time(NULL);
 
     bool no_colors = false; // Отключение цветов
     bool square_pixels = false; // Рисовать 2 символа на клетку
@@ -677,11 +3736,18 @@ int main(int argc, char *argv[]) {
     bool hover = false; // Курсор всегда двигается за мышкой
     bool auto_hide = false; // Автоматически скрывать курсор, когда он не двигается
     bool help = false;
+    bool headless = false; // Замерить скорость симуляции без терминала
+    bool check_threads = false; // Сравнить прогоны сценариев в одном и в нескольких потоках
+    Benchmark bench = {.width = 300, .height = 100, .ticks = 1000, .scenario = "sand_pile"};
+    const char *load_path = NULL; // Сохранение, с которого начать
+    const char *record_path = NULL; // Куда записывать команды
+    const char *stats_path = NULL; // Куда писать замеры профилирования
 
     while (--argc) {
         char *arg = *(++argv);
+        unsigned long long value; // Значение числовой опции
 
-        if (arg[0] == '-' && arg[1] != '-' && arg[1] != 'T' && arg[1] != 'w') {
+        if (arg[0] == '-' && arg[1] != '-' && (arg[1] == '\0' || strchr(VALUE_FLAGS, arg[1]) == NULL)) {
             char flag;
             while ((flag = *(++arg))) {
                 switch (flag) {
@@ -711,7 +3777,7 @@ int main(int argc, char *argv[]) {
                     return 1;
                 }
             }
-        } else if (arg[0] == '-' && (arg[1] == '-' || arg[1] == 'T' || arg[1] == 'w')) {
+        } else if (arg[0] == '-') {
             if (strcmp(arg, "--no-colors") == 0) {
                 no_colors = true;
             } else if (strcmp(arg, "--square") == 0) {
@@ -725,34 +3791,106 @@ int main(int argc, char *argv[]) {
             } else if (strcmp(arg, "--auto-hide") == 0) {
                 auto_hide = true;
             } else if (strcmp(arg, "--tps") == 0 || strcmp(arg, "-T") == 0) {
-                if (argc == 1) {
+                if (!parse_number(prog, arg, option_value(), &value)) return 1;
+                target_tps = value;
+            } else if (strcmp(arg, "--fps") == 0 || strcmp(arg, "-F") == 0) {
+                if (!parse_number(prog, arg, option_value(), &value)) return 1;
+                target_fps = value;
+                if (target_fps == 0) target_fps = 1;
+            } else if (strcmp(arg, "--water") == 0 || strcmp(arg, "-w") == 0) {
+                if (!parse_number(prog, arg, option_value(), &value)) return 1;
+                water_iterations = value;
+                if (water_iterations == 0) water_iterations = 1;
+                water_dispersion = 0;
+            } else if (strcmp(arg, "--dispersion") == 0) {
+                if (!parse_number(prog, arg, option_value(), &value)) return 1;
+                if (value < 1 || value > MAX_WATER_DISPERSION) {
+                    fprintf(stderr, "%s: %s must be between 1 and %d\n", prog, arg, MAX_WATER_DISPERSION);
+                    return 1;
+                }
+                water_dispersion = value;
+                water_iterations = 1;
+            } else if (strcmp(arg, "--order") == 0) {
+                char *name = option_value();
+                if (name == NULL) {
                     fprintf(stderr, "%s: no value for option '%s'\n", prog, arg);
                     return 1;
                 }
-                char *value_str = *(++argv); // Указатель на начало строки с числом TPS
-                argc--; 
-                
-                char *endp;
-                target_tps = strtoul(value_str, &endp, 10);
-                if (*endp != '\0') {
-                    fprintf(stderr, "%s: illegal value '%s' for option '%s'\n", prog, value_str, arg);
+                traversal_order = NUM_ORDERS;
+                for (int i = 0; i < NUM_ORDERS; i++) {
+                    if (strcmp(name, order_names[i]) == 0)
+                        traversal_order = i;
+                }
+                if (traversal_order == NUM_ORDERS) {
+                    fprintf(stderr, "%s: unknown order '%s'\n", prog, name);
                     return 1;
                 }
-            } else if (strcmp(arg, "--water") == 0 || strcmp(arg, "-w") == 0) {
-                if (argc == 1) {
+            } else if (strcmp(arg, "--threads") == 0 || strcmp(arg, "-j") == 0) {
+                if (!parse_number(prog, arg, option_value(), &value)) return 1;
+                int limit = cpu_count() * THREADS_PER_CPU;
+                if (value > (unsigned long long)limit) {
+                    fprintf(stderr, "%s: %s %llu is too many, using %d\n", prog, arg, value, limit);
+                    value = limit;
+                }
+                threads = value;
+                if (threads == 0) threads = cpu_count();
+            } else if (strcmp(arg, "--seed") == 0 || strcmp(arg, "-S") == 0) {
+                if (!parse_number(prog, arg, option_value(), &value)) return 1;
+                sim_seed = value;
+            } else if (strcmp(arg, "--headless") == 0) {
+                headless = true;
+            } else if (strcmp(arg, "--check-threads") == 0) {
+                check_threads = true;
+            } else if (strcmp(arg, "--size") == 0) {
+                if (!parse_size(prog, arg, option_value(), &bench.width, &bench.height)) return 1;
+            } else if (strcmp(arg, "--world") == 0) {
+                if (!parse_size(prog, arg, option_value(), &world_width, &world_height)) return 1;
+            } else if (strcmp(arg, "--ticks") == 0) {
+                if (!parse_number(prog, arg, option_value(), &value)) return 1;
+                if (value < 1) {
+                    fprintf(stderr, "%s: %s must be at least 1\n", prog, arg);
+                    return 1;
+                }
+                bench.ticks = value;
+            } else if (strcmp(arg, "--scenario") == 0) {
+                if ((bench.scenario = option_value()) == NULL) {
                     fprintf(stderr, "%s: no value for option '%s'\n", prog, arg);
                     return 1;
                 }
-                char *value_str = *(++argv); // Указатель на начало строки с числом итераций для воды
-                argc--;
-                
-                char *endp;
-                water_iterations = strtoul(value_str, &endp, 10);
-                if (*endp != '\0') {
-                    fprintf(stderr, "%s: illegal value '%s' for option '%s'\n", prog, value_str, arg);
+            } else if (strcmp(arg, "--load") == 0) {
+                if ((load_path = option_value()) == NULL) {
+                    fprintf(stderr, "%s: no value for option '%s'\n", prog, arg);
+                    return 1;
+                }
+                save_path = load_path;
+            } else if (strcmp(arg, "--record") == 0) {
+                if ((record_path = option_value()) == NULL) {
+                    fprintf(stderr, "%s: no value for option '%s'\n", prog, arg);
+                    return 1;
+                }
+            } else if (strcmp(arg, "--replay") == 0) {
+                if ((bench.replay = option_value()) == NULL) {
+                    fprintf(stderr, "%s: no value for option '%s'\n", prog, arg);
+                    return 1;
+                }
+            } else if (strcmp(arg, "--stats-file") == 0) {
+                if ((stats_path = option_value()) == NULL) {
+                    fprintf(stderr, "%s: no value for option '%s'\n", prog, arg);
+                    return 1;
+                }
+            } else if (strcmp(arg, "--backend") == 0) {
+                char *name = option_value();
+                if (name == NULL) {
+                    fprintf(stderr, "%s: no value for option '%s'\n", prog, arg);
+                    return 1;
+                } else if (strcmp(name, "ncurses") == 0) {
+                    backend = BACKEND_NCURSES;
+                } else if (strcmp(name, "ansi") == 0) {
+                    backend = BACKEND_ANSI;
+                } else {
+                    fprintf(stderr, "%s: unknown backend '%s'\n", prog, name);
                     return 1;
                 }
-                if (water_iterations == 0) water_iterations = 1;
             } else if (strcmp(arg, "--help") == 0) {
                 help = true;
             } else {
@@ -778,11 +3916,90 @@ Options:\n\
     --hover, -H             Kypcop всегда будет следить за мышкой, a не только при нажатии\n\
     --auto-hide, -a         Автоматически скрывать курсор, когда он не двигается\n\
     --tps, -T <number>      Устанавливает значение TPS (по умолчанию %d)\n\
-    --water, -w <number>    Устанавливает для воды количество итераций за тик (по умолчанию %d)\n",
-               prog, DEFAULT_TARGET_TPS, DEFAULT_WATER_ITERATIONS);
+    --fps, -F <number>      Как часто перерисовывать экран, не больше (по умолчанию %d)\n\
+    --dispersion <number>   На сколько клеток за тик может утечь вода (1..%d, по умолчанию %d)\n\
+    --water, -w <number>    Старый режим воды: вода ходит на клетку, но столько раз за тик\n\
+    --order <name>          Порядок обхода клеток строки: shuffle (по умолчанию), sweep, stride, checker\n\
+    --threads, -j <number>  Обновлять поле в нескольких потоках (0 – по числу ядер, по умолчанию 1)\n\
+    --seed, -S <number>     Зерно генератора случайных чисел (по умолчанию берётся из текущего времени)\n\
+    --world <W>x<H>         Размер поля, которое может быть больше экрана (по умолчанию по размеру терминала)\n\
+    --headless              Замерить скорость симуляции без терминала и вывести результат\n\
+    --size <W>x<H>          Размер поля для --headless (по умолчанию 300x100)\n\
+    --ticks <number>        Сколько тиков прогнать в --headless (по умолчанию 1000)\n\
+    --scenario <name>       Сценарий для --headless: sand_pile, water_tank, forest_fire, bomb_field\n\
+    --check-threads         Прогнать все сценарии в одном потоке и в --threads потоках (по умолчанию в 4)\n\
+                            и проверить, что поле и население совпали\n\
+    --backend <name>        Вывод на экран: ncurses (по умолчанию) или ansi (24-битные цвета, один write() на кадр)\n\
+    --load <file>           Начать с сохранения; размер поля берётся из файла. F5/F9 пишут и читают этот же файл\n\
+                            (по умолчанию %s)\n\
+    --record <file>         Записывать в файл все действия, которые меняют поле, с номером тика\n\
+    --replay <file>         Повторить запись с тем же зерном (со скоростью --tps, 0 – как можно быстрее)\n\
+    --stats-file <file>     Раз в секунду дописывать в файл замеры профилирования в формате CSV\n",
+               prog, DEFAULT_TARGET_TPS, DEFAULT_TARGET_FPS, MAX_WATER_DISPERSION, DEFAULT_WATER_DISPERSION, DEFAULT_SAVE_FILE);
         return 0;
     }
 
+    pthread_mutex_init(&curs_mtx, NULL);
+    pthread_mutex_init(&cellselect_mtx, NULL);
+    pthread_cond_init(&cellselect_cnd, NULL);
+
+    rng_seed(&thread_rng, sim_seed);
+    rng_seed(&render_rng, ~sim_seed);
+
+    ChunkLoader *loader = NULL;
+    if (load_path != NULL && (loader = loader_open(load_path)) == NULL) {
+        fprintf(stderr, "%s: cannot load '%s'\n", prog, load_path);
+        return 1;
+    }
+
+    if (bench.replay != NULL) {
+        if (record_path != NULL) {
+            fprintf(stderr, "%s: --record and --replay cannot be used together\n", prog);
+            return 1;
+        }
+        if (!replay_open(&replay, bench.replay)) {
+            fprintf(stderr, "%s: cannot replay '%s'\n", prog, bench.replay);
+            return 1;
+        }
+        if (loader != NULL && (replay.width != (int)loader->header.width || replay.height != (int)loader->header.height)) {
+            fprintf(stderr, "%s: '%s' was recorded on a %dx%d field\n", prog, bench.replay, replay.width, replay.height);
+            return 1;
+        }
+        water_iterations = replay.water;
+        water_dispersion = replay.dispersion;
+        traversal_order = replay.order;
+    }
+    if (record_path != NULL && (record_file = fopen(record_path, "w")) == NULL) {
+        fprintf(stderr, "%s: cannot open '%s'\n", prog, record_path);
+        return 1;
+    }
+
+    FILE *stats_file = NULL;
+    if (stats_path != NULL && (stats_file = fopen(stats_path, "w")) == NULL) {
+        fprintf(stderr, "%s: cannot open '%s'\n", prog, stats_path);
+        return 1;
+    }
+    profile_start(stats_file);
+
+    if (check_threads) {
+        if (loader != NULL || bench.replay != NULL) {
+            fprintf(stderr, "%s: --check-threads runs the built-in scenarios and cannot be used with --load or --replay\n", prog);
+            return 1;
+        }
+        int status = run_thread_check(prog, bench, water_iterations, (threads > 1 ? threads : 4));
+        if (stats_file != NULL)
+            fclose(stats_file);
+        return status;
+    }
+
+    if (headless) {
+        bench.load = loader;
+        int status = run_benchmark(prog, bench, water_iterations, threads, NULL);
+        if (stats_file != NULL)
+            fclose(stats_file);
+        return status;
+    }
+
     if (!initscr()) {
         fprintf(stderr, "%s: error initialising ncurses\n", prog);
         return 1;
@@ -806,31 +4023,14 @@ Options:\n\
     
     if (!no_colors) {
         start_color();
-        init_color(COLOR_YELLOW,    clr(220),   clr(217),   clr(37));   // rgb(220,217,37)
-        init_color(COLOR_BLUE,      clr(36),    clr(114),   clr(200));  // rgb(36,114,200)
-        init_color(COLOR_GRAY,      clr(140),   clr(140),   clr(140));  // rgb(140,140,140)
-        init_color(COLOR_DARKGRAY,  clr(51),    clr(51),    clr(51));   // rgb(51,51,51)
-        init_color(COLOR_BROWN,     clr(102),   clr(51),    0);         // rgb(102,51,0)
-        init_color(COLOR_RED,       clr(205),   clr(49),    clr(49));   // rgb(205, 49, 49)
-        init_color(COLOR_ORANGE,    clr(255),   clr(127),   0);         // rgb(255,127,0)
-        init_color(COLOR_GREEN,     clr(13),    clr(188),   clr(121));  // rgb(13,188,121)
-        init_color(COLOR_CYAN,      clr(129),   clr(160),   clr(200));  // rgb(129,160,200)
-        init_color(COLOR_CYAN_2,    clr(97),    clr(129),   clr(167));  // rgb(97, 129, 167)
-        init_color(COLOR_WHITE,     clr(255),   clr(255),   clr(255));  // rgb(255, 255, 255)
-        init_color(COLOR_BLACK,     0,          0,          0);         // rgb(0,0,0)
-
-        init_pair(EMPTY, COLOR_WHITE, COLOR_BLACK);
-        init_pair(SAND, COLOR_GRAY, COLOR_YELLOW);
-        init_pair(WATER, COLOR_WHITE, COLOR_BLUE);
-        init_pair(STONE, COLOR_GRAY, COLOR_DARKGRAY);
-        init_pair(WOOD, COLOR_WHITE, COLOR_BROWN);
-        init_pair(ASH, COLOR_DARKGRAY, COLOR_GRAY);
-        init_pair(FIRE, COLOR_WHITE, COLOR_RED);
-        init_pair(FIRE+CURSOR_ID, COLOR_DARKGRAY, COLOR_ORANGE);
-        init_pair(BOMB, COLOR_GRAY, COLOR_GREEN);
-        init_pair(STEAM, COLOR_GRAY, COLOR_CYAN);
-        init_pair(STEAM+CURSOR_ID, COLOR_GRAY, COLOR_CYAN_2);
-        init_pair(CURSOR_ID, COLOR_BLACK, COLOR_WHITE);
+        for (size_t i = 0; i < sizeof(palette)/sizeof(palette[0]); i++)
+            init_color(palette[i].color, clr(palette[i].r), clr(palette[i].g), clr(palette[i].b));
+        for (size_t i = 0; i < sizeof(color_pairs)/sizeof(color_pairs[0]); i++)
+            init_pair(color_pairs[i].pair, color_pairs[i].fg, color_pairs[i].bg);
+    }
+    if (backend == BACKEND_ANSI) {
+        ansi_init(no_colors);
+        wrefresh(win); // Рамку окна рисует ncurses, а поле – бэкенд ANSI
     }
 
     CellInfo cells_info[] = {
@@ -847,59 +4047,118 @@ Options:\n\
 
     wattron(win, COLOR_PAIR(EMPTY));
 
-    CellsMap map = {.cells = NULL, .width = COLS-2, .height = LINES-2};
-    
-    if (square_pixels) {
-        map.width /= 2;
+    view.width = (square_pixels ? MAPW/2 : MAPW);
+    view.height = MAPH;
+    if (replay.file != NULL) { // Запись повторяется на поле того же размера
+        world_width = replay.width;
+        world_height = replay.height;
+    } else if (loader != NULL) { // Размер поля в сохранении важнее --world и размера экрана
+        world_width = loader->header.width;
+        world_height = loader->header.height;
+    } else if (world_width == 0) { // Без --world поле занимает весь экран
+        world_width = view.width;
+        world_height = view.height;
     }
 
-    map.cells = calloc(MAPW*MAPH, sizeof(Cell));
-    if (map.cells == NULL) {
-        fprintf(stderr, "%s: error allocating memory\n", prog);
+    CellsMap map;
+    if (!map_create(&map, world_width, world_height)) {
+        map_destroy(&map);
+        loader_close(loader);
 
         printf("\033[?100%cl\n", (hover ? '3' : '2'));
         curs_set(1);
         delwin(win);
         endwin();
 
+        fprintf(stderr, "%s: error allocating memory\n", prog);
         return 1;
     }
+
+    if (threads > 1) // Если пул создать не получится, поле просто будет обновляться в одном потоке
+        update_pool = pool_create(threads, map.chunks_w*map.chunks_h);
     /*for (int i = 0; i < map.width*map.height; i++) {
-        if (rand() % 2)
-            map.cells[i].type = EMPTY;
+        if (rnd(2))
+            map.types[i] = EMPTY;
         else
-            map.cells[i].type = SAND;
+            map.types[i] = SAND;
     }*/
     
+    if (loader != NULL)
+        map_load(&map, loader);
+    if (replay.file != NULL) { // Сохранение могли сделать позже, чем начали запись
+        sim_seed = replay.seed;
+        update_passes = replay.passes;
+    }
+    if (record_file != NULL)
+        record_header(record_file, map.width, map.height, water_iterations);
+
     Cursor curs = {0, 2, .brush = SAND, .brush_size=1};
+    view_clamp(map);
+    Snapshots snaps = {.back = 0, .front = 2, .ready = 1};
 
-    pthread_mutex_init(&curs_mtx, NULL);
-    pthread_mutex_init(&map_mtx, NULL);
-    pthread_mutex_init(&cellselect_mtx, NULL);
-    pthread_cond_init(&cellselect_cnd, NULL);
+    #ifndef _WIN32
+        if (pipe(wakeup_pipe) == 0) {
+            fcntl(wakeup_pipe[0], F_SETFL, O_NONBLOCK);
+            fcntl(wakeup_pipe[1], F_SETFL, O_NONBLOCK);
+        } else {
+            wakeup_pipe[0] = wakeup_pipe[1] = -1; // Без пайпа поток ввода просто не проснётся раньше, чем придёт ввод
+        }
+    #endif
 
-    InputThreadArgs input_thrd_args = {.cr = &curs, .mp = &map, .sp = square_pixels, .hc = auto_hide};
+    InputThreadArgs input_thrd_args = {.cr = &curs, .mp = &map, .sp = square_pixels, .hc = auto_hide, .tps = target_tps};
     pthread_t input_thrd;
     pthread_create(&input_thrd, NULL, input_thread_loop, &input_thrd_args);
     pthread_detach(input_thrd);
 
-    do {
+    SimThreadArgs sim_thrd_args = {.mp = &map, .cr = &curs, .sn = &snaps, .tps = target_tps, .wi = water_iterations};
+    struct timespec sim_start, sim_end;
+    clock_gettime(CLOCK_MONOTONIC, &sim_start);
+    pthread_t sim_thrd;
+    bool sim_started = (pthread_create(&sim_thrd, NULL, sim_thread_loop, &sim_thrd_args) == 0);
+
+    bool redraw = true; // Экран нужно перерисовать, даже если снимок и курсор не менялись
+    Cursor shown_curs = curs;
+    bool shown_paused = paused;
+    const char *shown_notice = NULL;
+    bool shown_profile = false;
+    unsigned shown_samples = 0;
+    TickStats render_stats = {0}; // Время отрисовки кадров
+    Pacer render_pacer; // Кадры не догоняют расписание: опоздавший кадр просто пропускается
+    pacer_start(&render_pacer, target_fps, 0);
+
+    while (sim_started && run) {
         if (win_change) {
             resizeterm(0, 0);
 
             erase();
             box(win, 0, 0);
+            if (backend == BACKEND_ANSI)
+                clearok(curscr, TRUE);
             refresh();
+            touchwin(win);
+            if (backend == BACKEND_ANSI)
+                wrefresh(win);
+            render_invalidate();
+            redraw = true;
+
+            curs_lock();
+            view.width = (square_pixels ? MAPW/2 : MAPW);
+            view.height = MAPH;
+            view_follow(&curs, map);
+            pthread_mutex_unlock(&curs_mtx);
 
             win_change = false;
         }
 
         if (cellselect_open) {
             // cs = cellselect
-            int cs_win_height = map.height/1.5;
-            int cs_win_width = map.width/1.5;
-            int cs_win_x = map.width/6;
-            int cs_win_y = map.height/6;
+            int cs_win_height = view.height/1.5;
+            int cs_win_width = view.width/1.5;
+            int cs_win_x = view.width/6;
+            int cs_win_y = view.height/6;
+
+            if (backend == BACKEND_ANSI)
+                frame_sync_window(win);
 
             WINDOW *cs_win = newwin(cs_win_height, cs_win_width, cs_win_y, cs_win_x);
             nodelay(cs_win, TRUE);
@@ -913,10 +4172,12 @@ Options:\n\
             bool first_run = true;
             int c;
             while ((c = getch()) != '\t') {
-                if (first_run == true)
+                if (first_run == true) {
                     first_run = false;
-                else if (c == EOF)
+                } else if (c == ERR) {
+                    input_wait(-1);
                     continue;
+                }
                 else if (c == 'q') {
                     run = false;
                     break;
@@ -992,6 +4253,9 @@ Options:\n\
             }
 
             delwin(cs_win);
+            touchwin(win);
+            render_invalidate(); // Меню рисовало поверх поля
+            redraw = true;
 
             pthread_mutex_lock(&cellselect_mtx);
             cellselect_open = false;
@@ -999,46 +4263,91 @@ Options:\n\
             pthread_mutex_unlock(&cellselect_mtx);
         }
 
-        clock_t start_clock = clock();
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
 
-        if (!pause || step) {
-            update(map, false);
-            for (int i = 0; i < water_iterations-1; i++)
-                update(map, true);
-            step = false;
-        }
+        // Рисуем только тогда, когда симуляция опубликовала новый снимок или что-то поменялось в интерфейсе
+        curs_lock();
+        Cursor now_curs = curs;
+        ProfileSample profile_sample = profile.sample;
+        unsigned profile_samples = profile.samples;
+        pthread_mutex_unlock(&curs_mtx);
+        bool curs_changed = now_curs.x != shown_curs.x || now_curs.y != shown_curs.y || now_curs.brush != shown_curs.brush || \
+                            now_curs.brush_size != shown_curs.brush_size || now_curs.hide != shown_curs.hide;
 
-        render(win, map, curs, cells_info, square_pixels, simple_fire, simple_steam);
+        const char *now_notice = notice_text();
 
-        if (pause) {
-            wmove(win, 1, getmaxx(win)-2-6);
-            waddstr(win, "Paused");
-            wrefresh(win);
-        }
+        bool profile_changed = show_profile != shown_profile || (show_profile && profile_samples != shown_samples);
 
-        if (target_tps > 0) {
-            struct timespec delay = {0, 0};
-            if (target_tps == 1) {
-                delay.tv_sec = 1;
-            } else {
-                delay.tv_nsec = (NS / target_tps) - ((clock()-start_clock) * NS / CLOCKS_PER_SEC);
-            }
+        if (snapshot_acquire(&snaps) || redraw || curs_changed || paused != shown_paused || now_notice != shown_notice || profile_changed) {
+            shown_curs = now_curs;
+            shown_paused = paused;
+            shown_notice = now_notice;
+            shown_samples = profile_samples;
+            shown_profile = show_profile;
+            redraw = false;
 
-            nanosleep(&delay, NULL);
+            struct timespec render_start, render_end;
+            clock_gettime(CLOCK_MONOTONIC, &render_start);
+            render(win, &snaps, now_curs, cells_info, square_pixels, simple_fire, simple_steam, shown_paused, shown_notice,
+                   (shown_profile ? &profile_sample : NULL));
+            clock_gettime(CLOCK_MONOTONIC, &render_end);
+            __atomic_add_fetch(&profile.render_ns, elapsed_ns(render_start, render_end), __ATOMIC_RELAXED);
+            __atomic_add_fetch(&profile.frames, 1, __ATOMIC_RELAXED);
         }
-    } while (run);
 
-    pthread_mutex_destroy(&map_mtx);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        tick_stats_add(&render_stats, start, end);
+        pacer_wait(&render_pacer);
+    }
+
+    input_wakeup(); // Поток ввода мог уснуть в ожидании ввода
+    if (sim_started)
+        pthread_join(sim_thrd, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &sim_end);
+    snapshots_destroy(&snaps);
+
+    if (update_pool != NULL)
+        pool_destroy(update_pool);
+
     pthread_mutex_destroy(&curs_mtx);
     pthread_mutex_destroy(&cellselect_mtx);
     pthread_cond_destroy(&cellselect_cnd);
 
+    if (backend == BACKEND_ANSI)
+        printf("\033[0m"); // Бэкенд ANSI оставил включённым цвет последней пары
     printf("\033[?100%cl\n", (hover ? '3' : '2'));
     curs_set(1);
     delwin(win);
     endwin();
 
-    free(map.cells);
+    if (backend == BACKEND_ANSI && ansi.frames > 0) {
+        printf("ansi backend: %llu frames written, %.1f bytes/frame, %.3f writes/frame, %llu unchanged frames skipped\n",
+               ansi.frames, (double)ansi.bytes / ansi.frames, (double)ansi.writes / ansi.frames, ansi.unchanged);
+    }
+    printf("sim: %.1f ticks/sec (target %d), tick p50 %.3f ms, p99 %.3f ms, %llu ticks dropped\n",
+           tick_stats_rate(&sim_stats), target_tps, tick_stats_percentile(&sim_stats, 50) / 1e6,
+           tick_stats_percentile(&sim_stats, 99) / 1e6, sim_pacer.dropped);
+    printf("render: %.1f frames/sec (limit %d), frame p50 %.3f ms, p99 %.3f ms, %llu frames dropped\n",
+           tick_stats_rate(&render_stats), target_fps, tick_stats_percentile(&render_stats, 50) / 1e6,
+           tick_stats_percentile(&render_stats, 99) / 1e6, render_pacer.dropped);
+    if (record_file != NULL || replay.file != NULL) {
+        double seconds = elapsed_ns(sim_start, sim_end) / 1e9;
+        printf("%s: %llu ticks in %.3f s (%.1f ticks/sec), checksum %016llx\n", (replay.file != NULL ? "replay" : "record"),
+               sim_ticks, seconds, sim_ticks / seconds, (unsigned long long)map_checksum(map));
+    }
+    if (record_file != NULL)
+        fclose(record_file);
+    if (stats_file != NULL)
+        fclose(stats_file);
+    if (replay.file != NULL)
+        fclose(replay.file);
+
+    map_destroy(&map);
+    free(frame.shown);
+    free(frame.next);
+    free(frame.skip);
+    free(ansi.buf);
 
     return 0;
 }